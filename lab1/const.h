@@ -10,15 +10,15 @@
 #define INT_SYS_YIELD		50
 #define INT_SYS_EXIT		51
 #define INT_SYS_WAIT		52
-
-// These system call numbers currently do nothing; feel free to define them
-// as you like.
-
-#define INT_SYS_USER1		53
-#define INT_SYS_USER2		54
-#define INT_SYS_USER3		55
-#define INT_SYS_USER4		56
-#define INT_SYS_USER5		57
+#define INT_SYS_WAITANY		53
+#define INT_SYS_SPAWN		54
+#define INT_SYS_THREAD_CREATE	55
+#define INT_SYS_THREAD_JOIN	56
+#define INT_SYS_CONSOLE_FLUSH	57
+#define INT_SYS_PIPE		58
+#define INT_SYS_READ		59
+#define INT_SYS_WRITE		60
+#define INT_SYS_CLOSE		61
 
 
 // The maximum number of processes in the system.
@@ -26,13 +26,60 @@
 #define NPROCS			16
 
 
-// Value returned by sys_wait() to indicate that the caller should try again.
+// Value once returned by sys_wait() to indicate that the caller should try
+// again.  sys_wait() now blocks instead, so it never returns this; the
+// value stays so that retry loops written for it still work.
 
 #define WAIT_TRYAGAIN		(-2)
 
 
-// The current screen cursor position (stored at memory location 0x190000).
+// The current screen cursor position (stored at memory location 0x60000).
 
 extern uint16_t *cursorpos;
 
+
+// The kernel data page (stored at memory location 0x61000).
+// The kernel keeps this page up to date with information about the system
+// and the running process, so applications can read that information with
+// plain loads instead of system calls.  Applications must not write it.
+// MiniprocOS has no clock interrupt, so its ticks are milliseconds of
+// cycle counter time, as of the last time the kernel ran.
+
+typedef struct kerneldata {
+	pid_t kd_pid;			// Running process's ID
+	uint32_t kd_ticks;		// Milliseconds since boot
+	uint32_t kd_tsc_khz;		// Cycle counter rate, in cycles per ms
+	uint32_t kd_nrunnable;		// Number of runnable processes
+	uint32_t kd_nruns;		// Times this process has been run
+} kerneldata_t;
+
+#ifdef WEENSYOS_KERNEL
+extern volatile kerneldata_t kerneldata;
+#else
+extern const volatile kerneldata_t kerneldata;
+#endif
+
+
+// The console buffer page (stored at memory location 0x7FF000).
+// Every process has its own: app_printf() (see process.h) collects output
+// there, as console cells, and sys_console_flush() has the kernel copy the
+// whole buffer onto the screen in one go.  Threads share their process's
+// buffer.  A line-buffered console (the default) flushes after every
+// app_printf() that prints a newline; a fully buffered one only when the
+// buffer fills up or the process calls sys_console_flush().  The kernel
+// also flushes a process's buffer when it forks or exits.
+
+#define CONSOLEBUF_SIZE		2044	// Cells in the buffer
+
+#define CONSOLEBUF_LINE		0	// Flush after each line (default)
+#define CONSOLEBUF_FULL		1	// Flush only when full, or explicitly
+
+typedef struct consolebuf {
+	uint32_t cb_len;		// Number of cells in use
+	uint32_t cb_mode;		// CONSOLEBUF_LINE or CONSOLEBUF_FULL
+	uint16_t cb_cells[CONSOLEBUF_SIZE];	// Characters and colors
+} consolebuf_t;
+
+extern consolebuf_t consolebuf;
+
 #endif
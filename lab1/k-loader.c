@@ -13,7 +13,6 @@
  *****************************************************************************/
 
 #define SECTORSIZE		512
-#define PAGESIZE		4096
 
 extern uint8_t _binary_obj_p_procos_app_start[];
 extern uint8_t _binary_obj_p_procos_app_end[];
@@ -21,6 +20,8 @@ extern uint8_t _binary_obj_p_procos_app2_start[];
 extern uint8_t _binary_obj_p_procos_app2_end[];
 extern uint8_t _binary_obj_p_procos_app3_start[];
 extern uint8_t _binary_obj_p_procos_app3_end[];
+extern uint8_t _binary_obj_p_procos_bench_start[];
+extern uint8_t _binary_obj_p_procos_bench_end[];
 
 struct ramimage {
 	void *begin;
@@ -28,7 +29,8 @@ struct ramimage {
 } ramimages[] = {
 	{ _binary_obj_p_procos_app_start, _binary_obj_p_procos_app_end },
 	{ _binary_obj_p_procos_app2_start, _binary_obj_p_procos_app2_end },
-	{ _binary_obj_p_procos_app3_start, _binary_obj_p_procos_app3_end }
+	{ _binary_obj_p_procos_app3_start, _binary_obj_p_procos_app3_end },
+	{ _binary_obj_p_procos_bench_start, _binary_obj_p_procos_bench_end }
 };
 
 static void copyseg(void *dst, const uint8_t *src,
@@ -71,10 +73,9 @@ copyseg(void *dst, const uint8_t *src, uint32_t filesz, uint32_t memsz)
 	uint32_t va = (uint32_t) dst;
 	uint32_t end_va = va + filesz;
 	memsz += va;
-	va &= ~(PAGESIZE - 1);		// round to page boundary
 
 	// copy data
-	memcpy((uint8_t *) va, src, end_va - va);
+	memcpy((uint8_t *) va, src, filesz);
 
 	// clear bss segment
 	while (end_va < memsz)
@@ -0,0 +1,116 @@
+#include "kernel.h"
+#include "x86.h"
+#include "lib.h"
+
+/*****************************************************************************
+ * k-palloc.c
+ *
+ *   The physical page allocator.
+ *
+ *   Pages from FRAME_POOL_START to FRAME_POOL_END hold page directories,
+ *   page tables, and process stacks.  Free pages are kept on a list linked
+ *   through their first word.  Each page has a reference count, since a
+ *   stack page can be shared copy-on-write by several processes after
+ *   sys_fork(); page_decref() frees a page when its last reference goes
+ *   away.
+ *
+ *****************************************************************************/
+
+#define NFRAMES		((FRAME_POOL_END - FRAME_POOL_START) / PAGESIZE)
+#define FRAMENUM(pa)	(((pa) - FRAME_POOL_START) / PAGESIZE)
+
+static uint16_t page_refcounts[NFRAMES];
+static physaddr_t free_list;		// First free page, or 0
+static int nfree;			// Number of free pages
+
+static bool_t
+page_in_pool(physaddr_t pa)
+{
+	return pa >= FRAME_POOL_START && pa < FRAME_POOL_END;
+}
+
+
+/*****************************************************************************
+ * page_alloc_init
+ *
+ *   Put every page in the pool on the free list.
+ *
+ * page_alloc
+ *
+ *   Allocate a page and return its physical address, or 0 if there are no
+ *   free pages.  The page is not cleared; its reference count is 1.
+ *
+ *****************************************************************************/
+
+void
+page_alloc_init(void)
+{
+	physaddr_t pa;
+	for (pa = FRAME_POOL_END - PAGESIZE; pa >= FRAME_POOL_START;
+	     pa -= PAGESIZE) {
+		*(physaddr_t *) pa = free_list;
+		free_list = pa;
+		nfree++;
+	}
+}
+
+physaddr_t
+page_alloc(void)
+{
+	physaddr_t pa = free_list;
+	if (pa) {
+		free_list = *(physaddr_t *) pa;
+		page_refcounts[FRAMENUM(pa)] = 1;
+		nfree--;
+	}
+	return pa;
+}
+
+
+/*****************************************************************************
+ * page_incref(pa)
+ * page_decref(pa)
+ *
+ *   Add or drop a reference to the page at 'pa'.  Dropping the last
+ *   reference frees the page.  Pages outside the pool, such as the
+ *   application's code and globals, are ignored.
+ *
+ * page_refcount(pa)
+ *
+ *   Return the number of references to the page at 'pa', or 0 if the page
+ *   is outside the pool.
+ *
+ * page_alloc_free_pages()
+ *
+ *   Return the number of free pages.
+ *
+ *****************************************************************************/
+
+void
+page_incref(physaddr_t pa)
+{
+	if (page_in_pool(pa))
+		page_refcounts[FRAMENUM(pa)]++;
+}
+
+void
+page_decref(physaddr_t pa)
+{
+	if (page_in_pool(pa) && --page_refcounts[FRAMENUM(pa)] == 0) {
+		*(physaddr_t *) pa = free_list;
+		free_list = pa;
+		nfree++;
+	}
+}
+
+int
+page_refcount(physaddr_t pa)
+{
+	return page_in_pool(pa) ? page_refcounts[FRAMENUM(pa)] : 0;
+}
+
+int
+page_alloc_free_pages(void)
+{
+	return nfree;
+}
@@ -0,0 +1,257 @@
+#include "kernel.h"
+#include "x86.h"
+#include "lib.h"
+
+/*****************************************************************************
+ * k-pipe.c
+ *
+ *   Pipes.
+ *
+ *   A pipe is a PIPE_SIZE-byte ring buffer in the kernel with a read end
+ *   and a write end.  Processes reach pipe ends through small integer file
+ *   descriptors, indexes into their p_fds arrays.  A new process or thread
+ *   starts out with copies of its parent's descriptors, so a parent can
+ *   create a pipe, fork, and talk to its child through it.
+ *
+ *   Reading an empty pipe, or writing a full one, blocks the caller on the
+ *   pipe's queue of readers or writers.  A blocked process is set up to
+ *   repeat its system call: its %eip is moved back over the 'int'
+ *   instruction, so when the other side makes progress and wakes it, it
+ *   traps again with the same arguments.  Data moves between the ring and
+ *   user memory with memcpy(), in at most two chunks (before and after the
+ *   ring wraps), never a byte at a time.
+ *
+ *****************************************************************************/
+
+static pipe_t pipe_array[NPIPES];
+
+// Length of the 'int $N' instruction that made a system call
+#define INT_INSN_SIZE		2
+
+static filedesc_t *
+fd_lookup(process_t *proc, int fd)
+{
+	if (fd < 0 || fd >= PROC_NFDS || !proc->p_fds[fd].fd_pipe)
+		return NULL;
+	return &proc->p_fds[fd];
+}
+
+static int
+fd_alloc(process_t *proc)
+{
+	int fd;
+	for (fd = 0; fd < PROC_NFDS; fd++)
+		if (!proc->p_fds[fd].fd_pipe)
+			return fd;
+	return -1;
+}
+
+// Check that the current process may access [va, va + n) ('write' says
+// how), and fault in any demand-zero or copy-on-write pages, so the kernel
+// can then copy to or from it without faulting.  Returns 0 or -1.
+static int
+user_buffer_check(process_t *proc, uintptr_t va, size_t n, bool_t write)
+{
+	uintptr_t end = va + n;
+	if (end < va)
+		return -1;
+	for (va = ROUNDDOWN(va, PAGESIZE); va < end; va += PAGESIZE)
+		if (virtual_memory_fault(proc->p_pagedir, va, write) < 0)
+			return -1;
+	return 0;
+}
+
+// Block 'proc' on the queue '*queue', to repeat its system call later.
+static void
+pipe_block(process_t *proc, process_t **queue)
+{
+	proc->p_registers.reg_eip -= INT_INSN_SIZE;
+	proc->p_wait_next = *queue;
+	*queue = proc;
+	proc->p_state = P_BLOCKED;
+}
+
+// Wake every process on the queue '*queue'.
+static void
+pipe_wake(process_t **queue)
+{
+	process_t *proc;
+	while ((proc = *queue)) {
+		*queue = proc->p_wait_next;
+		proc->p_wait_next = NULL;
+		proc->p_state = P_RUNNABLE;
+	}
+}
+
+
+/*****************************************************************************
+ * pipe_create(proc)
+ *
+ *   Create a pipe and open both its ends in 'proc'.  Puts the read end's
+ *   descriptor in 'proc's %eax and the write end's in %ebx, and returns 0;
+ *   returns -1 if there is no free pipe or descriptor.
+ *
+ *****************************************************************************/
+
+int
+pipe_create(process_t *proc)
+{
+	pipe_t *pp;
+	int rfd, wfd;
+
+	for (pp = pipe_array; pp < pipe_array + NPIPES; pp++)
+		if (pp->pp_nreaders == 0 && pp->pp_nwriters == 0)
+			break;
+	if (pp == pipe_array + NPIPES || (rfd = fd_alloc(proc)) < 0)
+		return -1;
+	proc->p_fds[rfd].fd_pipe = pp;
+	if ((wfd = fd_alloc(proc)) < 0) {
+		proc->p_fds[rfd].fd_pipe = NULL;
+		return -1;
+	}
+	proc->p_fds[rfd].fd_write = 0;
+	proc->p_fds[wfd].fd_pipe = pp;
+	proc->p_fds[wfd].fd_write = 1;
+
+	pp->pp_head = pp->pp_len = 0;
+	pp->pp_nreaders = pp->pp_nwriters = 1;
+	pp->pp_readers = pp->pp_writers = NULL;
+	proc->p_registers.reg_eax = rfd;
+	proc->p_registers.reg_ebx = wfd;
+	return 0;
+}
+
+
+/*****************************************************************************
+ * pipe_read(proc, fd, buf, n)
+ *
+ *   Read up to 'n' bytes from the pipe open for reading as 'proc's 'fd'
+ *   into 'proc's memory at 'buf'.  Returns the number of bytes read, which
+ *   is 0 only at end of file (the pipe is empty and has no writers left),
+ *   or -1 on error.  If the pipe is empty but still has writers, blocks
+ *   'proc' and returns PIPE_BLOCKED; the caller should then schedule().
+ *
+ * pipe_write(proc, fd, buf, n)
+ *
+ *   Write up to 'n' bytes from 'proc's memory at 'buf' into the pipe open
+ *   for writing as 'proc's 'fd'.  Returns the number of bytes written,
+ *   which may be fewer than 'n' if the pipe fills up, or -1 on error
+ *   (including if the pipe has no readers left).  If the pipe is full,
+ *   blocks 'proc' and returns PIPE_BLOCKED.
+ *
+ *****************************************************************************/
+
+ssize_t
+pipe_read(process_t *proc, int fd, uintptr_t buf, size_t n)
+{
+	filedesc_t *f = fd_lookup(proc, fd);
+	pipe_t *pp;
+	size_t chunk;
+
+	if (!f || f->fd_write || user_buffer_check(proc, buf, n, 1) < 0)
+		return -1;
+	pp = f->fd_pipe;
+	if (n == 0 || (pp->pp_len == 0 && pp->pp_nwriters == 0))
+		return 0;
+	if (pp->pp_len == 0) {
+		pipe_block(proc, &pp->pp_readers);
+		return PIPE_BLOCKED;
+	}
+
+	n = MIN(n, pp->pp_len);
+	chunk = MIN(n, PIPE_SIZE - pp->pp_head);
+	memcpy((void *) buf, &pp->pp_buf[pp->pp_head], chunk);
+	memcpy((void *) (buf + chunk), pp->pp_buf, n - chunk);
+	pp->pp_head = (pp->pp_head + n) % PIPE_SIZE;
+	pp->pp_len -= n;
+	pipe_wake(&pp->pp_writers);
+	return n;
+}
+
+ssize_t
+pipe_write(process_t *proc, int fd, uintptr_t buf, size_t n)
+{
+	filedesc_t *f = fd_lookup(proc, fd);
+	pipe_t *pp;
+	size_t tail, chunk;
+
+	if (!f || !f->fd_write || user_buffer_check(proc, buf, n, 0) < 0)
+		return -1;
+	pp = f->fd_pipe;
+	if (pp->pp_nreaders == 0)
+		return -1;
+	if (n == 0)
+		return 0;
+	if (pp->pp_len == PIPE_SIZE) {
+		pipe_block(proc, &pp->pp_writers);
+		return PIPE_BLOCKED;
+	}
+
+	n = MIN(n, PIPE_SIZE - pp->pp_len);
+	tail = (pp->pp_head + pp->pp_len) % PIPE_SIZE;
+	chunk = MIN(n, PIPE_SIZE - tail);
+	memcpy(&pp->pp_buf[tail], (const void *) buf, chunk);
+	memcpy(pp->pp_buf, (const void *) (buf + chunk), n - chunk);
+	pp->pp_len += n;
+	pipe_wake(&pp->pp_readers);
+	return n;
+}
+
+
+/*****************************************************************************
+ * fd_close(proc, fd)
+ *
+ *   Close 'proc's file descriptor 'fd'.  Closing a pipe's last write end
+ *   wakes its readers, who then see end of file; closing its last read end
+ *   wakes its writers, whose writes then fail.  Returns 0, or -1 if 'fd'
+ *   is not open.
+ *
+ * fd_fork(child, parent)
+ *
+ *   Give 'child' copies of all of 'parent's file descriptors.
+ *
+ * fd_close_all(proc)
+ *
+ *   Close all of 'proc's file descriptors, as when it exits.
+ *
+ *****************************************************************************/
+
+int
+fd_close(process_t *proc, int fd)
+{
+	filedesc_t *f = fd_lookup(proc, fd);
+	pipe_t *pp;
+
+	if (!f)
+		return -1;
+	pp = f->fd_pipe;
+	if (f->fd_write && --pp->pp_nwriters == 0)
+		pipe_wake(&pp->pp_readers);
+	else if (!f->fd_write && --pp->pp_nreaders == 0)
+		pipe_wake(&pp->pp_writers);
+	f->fd_pipe = NULL;
+	return 0;
+}
+
+void
+fd_fork(process_t *child, process_t *parent)
+{
+	int fd;
+	for (fd = 0; fd < PROC_NFDS; fd++) {
+		child->p_fds[fd] = parent->p_fds[fd];
+		if (!child->p_fds[fd].fd_pipe)
+			continue;
+		else if (child->p_fds[fd].fd_write)
+			child->p_fds[fd].fd_pipe->pp_nwriters++;
+		else
+			child->p_fds[fd].fd_pipe->pp_nreaders++;
+	}
+}
+
+void
+fd_close_all(process_t *proc)
+{
+	int fd;
+	for (fd = 0; fd < PROC_NFDS; fd++)
+		fd_close(proc, fd);
+}
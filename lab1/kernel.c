@@ -14,13 +14,9 @@
 // The kernel is loaded starting at 0x100000.
 // The miniprocos applications are also available in RAM in packed form.
 // The kernel loads one of those applications into memory starting at 0x200000.
-// It also allocates 1/4 MB for each possible miniprocess's stack, starting at
-// 0x280000.
-// Each process's stack grows down from the top of its stack space.
-
-#define PROC1_STACK_ADDR	0x280000
-#define PROC_STACK_SIZE		0x040000
-
+// Page directories, page tables, and process stacks come from a pool of
+// physical pages starting at 0x280000 (FRAME_POOL_START; see k-palloc.c).
+//
 // MINIPROCOS MEMORY MAP
 //
 // +--------------------------+--------------+----------------------------+-/
@@ -29,20 +25,28 @@
 // +--------------------------+--------------+----------------------------+-/
 // 0                       0xA0000       0x100000                     0x200000
 //
-//         /-+----------------+------------+------------+------------+---/
-//           |   Application  | Miniproc 1 | Miniproc 2 | Miniproc 3 |
-//           | Code + Globals |      Stack |      Stack |      Stack |
-//         /-+----------------+------------+------------+------------+---/
-//       0x200000         0x280000     0x2C0000     0x300000     0x340000
-//                            |            |            |
-//                    PROC1_STACK_ADDR     |     PROC1_STACK_ADDR
-//                                         |    + 2*PROC_STACK_SIZE
-//                                         |
-//                                  PROC1_STACK_ADDR
-//                                 + PROC_STACK_SIZE
+//         /-+----------------+--------------------------+
+//           |   Application  |  Page pool (page tables, |
+//           | Code + Globals |  stack pages)            |
+//         /-+----------------+--------------------------+
+//       0x200000         0x280000                   0x400000
+//
+// With paging on, each process has its own page directory, which maps the
+// memory above at the same addresses in every process -- so all processes
+// share the application's code and globals -- plus the process's own
+// stack.  Every process's stack grows down from PROC_STACK_TOP (0x7FF000),
+// a page at a time as the process touches the guard page below it, for
+// at most PROC_STACK_LIMIT bytes.  Just above the stack is the process's
+// console buffer page, 'consolebuf' (see const.h).
+// After sys_fork(), parent and child share their stack pages copy-on-write.
+// Threads (see do_thread_create()) share their creator's page directory,
+// and get their stacks from the pool of addresses starting at 0x1000000
+// (THREAD_STACK_START).
 //
 // There is also a shared 'cursorpos' variable, located at 0x60000 in the
 // kernel's data area.  (This is used by 'app_printf' in process.h.)
+// The kernel data page, 'kerneldata', is at 0x61000.  The kernel keeps it
+// up to date for the running process; see const.h.
 
 
 // A process descriptor for each possible miniprocess.
@@ -54,6 +58,17 @@ static process_t proc_array[NPROCS];
 // This is kept up to date by the run() function, in x86.c.
 process_t *current;
 
+// Empty process descriptors, linked through p_free_next.  process_alloc()
+// takes from the front, and process_reap() puts descriptors back at the
+// end, so a freed process ID is reused as late as possible.
+static process_t *free_procs;
+static process_t **free_procs_tail = &free_procs;
+
+// Cycle counter value at boot, from which kerneldata.kd_ticks counts
+static uint64_t boot_cycles;
+
+static pagedirectory_t process_pagedir_create(void);
+
 
 
 /*****************************************************************************
@@ -71,11 +86,17 @@ start(void)
 	int whichprocess;
 	pid_t i;
 
-	// Initialize process descriptors as empty
+	// Initialize process descriptors as empty, and put all but the first
+	// process's on the free list.
 	memset(proc_array, 0, sizeof(proc_array));
 	for (i = 0; i < NPROCS; i++) {
-		proc_array[i].p_pid = i;
+		proc_array[i].p_pid = proc_array[i].p_tgid = i;
+		proc_array[i].p_tgrefs = 1;
 		proc_array[i].p_state = P_EMPTY;
+		if (i > 1) {
+			*free_procs_tail = &proc_array[i];
+			free_procs_tail = &proc_array[i].p_free_next;
+		}
 	}
 
 	// The first process has process ID 1.
@@ -87,16 +108,27 @@ start(void)
 	// first process.
 	segments_init();
 	special_registers_init(current);
+	fpu_init();
+
+	// Turn on paging.
+	page_alloc_init();
+	virtual_memory_init();
 
 	// Erase the console, and initialize the cursor-position shared
 	// variable to point to its upper left.
 	console_clear();
 
+	// Initialize the kernel data page.
+	memset((void *) &kerneldata, 0, sizeof(kerneldata));
+	kerneldata.kd_tsc_khz = cycle_counter_calibrate();
+	boot_cycles = read_cycle_counter();
+
 	// Figure out which program to run.
-	cursorpos = console_printf(cursorpos, 0x0700, "Type '1' to run procos-app,'2' for procos-app2, '3' for procos-app3.");
+	cursorpos = console_printf(cursorpos, 0x0700, "Type '1' to run procos-app,'2' for procos-app2, '3' for procos-app3,\n"
+				   "'4' for procos-bench.");
 	do {
 		whichprocess = console_read_digit();
-	} while (whichprocess != 1 && whichprocess != 2 && whichprocess != 3);
+	} while (whichprocess < 1 || whichprocess > 4);
 	console_clear();
 
 	// Load the process application code and data into memory.
@@ -104,8 +136,12 @@ start(void)
 	// (instruction pointer).
 	program_loader(whichprocess - 1, &current->p_registers.reg_eip);
 
-	// Set the main process's stack pointer, ESP.
-	current->p_registers.reg_esp = PROC1_STACK_ADDR + PROC_STACK_SIZE;
+	// Give the main process a page directory and a demand-zero stack,
+	// and set its stack pointer, ESP.
+	if (!(current->p_pagedir = process_pagedir_create()))
+		while (1)
+			/* do nothing */;
+	current->p_registers.reg_esp = PROC_STACK_TOP;
 
 	// Mark the process as runnable!
 	current->p_state = P_RUNNABLE;
@@ -125,6 +161,20 @@ start(void)
  *****************************************************************************/
 
 static pid_t do_fork(process_t *parent);
+static pid_t do_spawn(process_t *parent, uintptr_t entry, uint32_t arg);
+static pid_t do_thread_create(process_t *parent, uintptr_t fn, uint32_t arg,
+			      size_t stack_size);
+static process_t *process_alloc(void);
+static int process_entry_init(process_t *proc, uintptr_t entry, uintptr_t sp,
+			      uint32_t arg);
+static void process_wait(process_t *proc);
+static int process_stack_grow(process_t *proc, uintptr_t addr,
+			      uintptr_t esp);
+static void console_flush(process_t *proc);
+static pid_t process_start(process_t *child, process_t *parent);
+static void process_exit(process_t *proc, int status);
+static int process_reap(process_t *proc);
+static void process_memory_free(process_t *proc);
 
 void
 interrupt(registers_t *reg)
@@ -154,6 +204,14 @@ interrupt(registers_t *reg)
 		current->p_registers.reg_eax = do_fork(current);
 		run(current);
 
+	case INT_SYS_SPAWN:
+		// 'sys_spawn' creates a new process that starts running at
+		// address %eax on a fresh stack, with %ebx as its argument.
+		current->p_registers.reg_eax =
+			do_spawn(current, current->p_registers.reg_eax,
+				 current->p_registers.reg_ebx);
+		run(current);
+
 	case INT_SYS_YIELD:
 		// The 'sys_yield' system call asks the kernel to schedule a
 		// different process.  (MiniprocOS is cooperatively
@@ -168,8 +226,7 @@ interrupt(registers_t *reg)
 		// before calling the system call.  The %eax REGISTER has
 		// changed by now, but we can read the APPLICATION's setting
 		// for this register out of 'current->p_registers'.
-		current->p_state = P_ZOMBIE;
-		current->p_exit_status = current->p_registers.reg_eax;
+		process_exit(current, current->p_registers.reg_eax);
 		schedule();
 
 	case INT_SYS_WAIT: {
@@ -181,18 +238,141 @@ interrupt(registers_t *reg)
 		// (In the Unix operating system, only process P's parent
 		// can call sys_wait(P).  In MiniprocOS, we allow ANY
 		// process to call sys_wait(P).)
+		// If P has not exited yet, the caller blocks on P's wait
+		// queue until it does; see process_exit().  Collecting an
+		// exit status frees P's process descriptor.
 
 		pid_t p = current->p_registers.reg_eax;
 		if (p <= 0 || p >= NPROCS || p == current->p_pid
-		    || proc_array[p].p_state == P_EMPTY)
+		    || proc_array[p].p_state == P_EMPTY) {
+			current->p_registers.reg_eax = -1;
+			run(current);
+		}
+		process_wait(&proc_array[p]);
+	}
+
+	case INT_SYS_WAITANY: {
+		// 'sys_waitany' returns the process ID (in %eax) and exit
+		// status (in %ebx) of any exited child of the current
+		// process.  Exited children wait on the parent's zombie
+		// queue, so this takes the first one; if there is none, the
+		// caller blocks until a child exits (see process_exit()).
+		// It's an error to call sys_waitany with no children left.
+		process_t *child = current->p_zombies;
+		if (child) {
+			current->p_registers.reg_eax = child->p_pid;
+			current->p_registers.reg_ebx = process_reap(child);
+			run(current);
+		} else if (current->p_nchildren == 0) {
+			current->p_registers.reg_eax = -1;
+			run(current);
+		}
+		current->p_waitany = 1;
+		current->p_state = P_BLOCKED;
+		schedule();
+	}
+
+	case INT_SYS_THREAD_CREATE:
+		// 'sys_thread_create' creates a new thread in the current
+		// process's address space, running function %eax with
+		// argument %ebx on a stack of %ecx bytes.
+		current->p_registers.reg_eax =
+			do_thread_create(current, current->p_registers.reg_eax,
+					 current->p_registers.reg_ebx,
+					 current->p_registers.reg_ecx);
+		run(current);
+
+	case INT_SYS_CONSOLE_FLUSH:
+		// 'sys_console_flush' copies the process's console buffer
+		// onto the screen.
+		console_flush(current);
+		run(current);
+
+	case INT_SYS_PIPE:
+		// 'sys_pipe' creates a pipe, returning its read end's file
+		// descriptor in %eax and its write end's in %ebx (see
+		// k-pipe.c).
+		if (pipe_create(current) < 0)
 			current->p_registers.reg_eax = -1;
-		else if (proc_array[p].p_state == P_ZOMBIE)
-			current->p_registers.reg_eax = proc_array[p].p_exit_status;
+		run(current);
+
+	case INT_SYS_READ:
+	case INT_SYS_WRITE: {
+		// 'sys_read' and 'sys_write' move up to %ecx bytes between
+		// the memory at %ebx and the pipe at file descriptor %eax.
+		// If the pipe is empty (for sys_read) or full (sys_write),
+		// the caller blocks.
+		registers_t *r = &current->p_registers;
+		ssize_t n;
+		if (r->reg_intno == INT_SYS_READ)
+			n = pipe_read(current, r->reg_eax, r->reg_ebx,
+				      r->reg_ecx);
 		else
-			current->p_registers.reg_eax = WAIT_TRYAGAIN;
+			n = pipe_write(current, r->reg_eax, r->reg_ebx,
+				       r->reg_ecx);
+		if (n == PIPE_BLOCKED)
+			schedule();
+		r->reg_eax = n;
+		run(current);
+	}
+
+	case INT_SYS_CLOSE:
+		// 'sys_close' closes file descriptor %eax.
+		current->p_registers.reg_eax =
+			fd_close(current, current->p_registers.reg_eax);
+		run(current);
+
+	case INT_SYS_THREAD_JOIN: {
+		// 'sys_thread_join' is sys_wait for threads, but only works
+		// on another thread of the caller's own thread group.
+		pid_t t = current->p_registers.reg_eax;
+		if (t <= 0 || t >= NPROCS || t == current->p_pid
+		    || proc_array[t].p_state == P_EMPTY
+		    || !proc_array[t].p_stack_top
+		    || proc_array[t].p_tgid != current->p_tgid) {
+			current->p_registers.reg_eax = -1;
+			run(current);
+		}
+		process_wait(&proc_array[t]);
+	}
+
+	case INT_PAGEFAULT: {
+		// A process touched memory its page directory does not let
+		// it access.  If it touched the guard page below its stack,
+		// grow the stack.  If the page is demand-zero or
+		// copy-on-write, fix it up and let the process retry;
+		// otherwise, kill the process.  A process stopped by a guard
+		// page overflowed its stack.
+		uint32_t addr = rcr2();
+		bool_t write = (reg->reg_err & PFERR_WRITE) != 0;
+		pte_t *pte;
+		if (reg->reg_err & PFERR_USER) {
+			process_stack_grow(current, addr, reg->reg_esp);
+			if (virtual_memory_fault(current->p_pagedir, addr,
+						 write) == 0)
+				run(current);
+		}
+		pte = virtual_memory_lookup(current->p_pagedir, addr);
+		console_flush(current);
+		cursorpos = console_printf(cursorpos, 0x0C00,
+					   "\nProcess %d: %s at %x, eip %x\n",
+					   current->p_pid,
+					   pte && (*pte & PTE_GUARD)
+					   ? "stack overflow" : "page fault",
+					   addr, reg->reg_eip);
+		if (!(reg->reg_err & PFERR_USER))
+			while (1)
+				/* do nothing */;
+		process_exit(current, -1);
 		schedule();
 	}
 
+	case INT_FPU:
+		// A process used the FPU while another process's state was
+		// in it.
+		fpu_trap();
+		run(current);
+
 	default:
 		while (1)
 			/* do nothing */;
@@ -210,116 +390,539 @@ interrupt(registers_t *reg)
  *   (1) its registers, and (2) its stack -- that's it.  All processes share
  *   THE SAME code and global variables.  (So really we should call them
  *   "miniprocesses" or something.)
- *   The parent process is passed in as an argument.  The function should
- *   return the process ID of the child process, or -1 if the function can't
- *   create a child process.
- *   Your job is to fill it in!
+ *   The parent process is passed in as an argument.  The function returns
+ *   the process ID of the child process, or -1 if it can't create a child
+ *   process.
+ *
+ *   The child's stack is a copy-on-write copy of the parent's (see
+ *   pagedir_fork() in x86.c): both processes keep using the same stack
+ *   pages until one of them writes to a page, and only that page gets
+ *   copied.  Since every process's stack lives at the same virtual
+ *   addresses, the child's registers -- including its stack pointer --
+ *   are the parent's, except that sys_fork() returns 0 in the child.
  *
  *****************************************************************************/
 
-static void copy_stack(process_t *dest, process_t *src);
-
 static pid_t
 do_fork(process_t *parent)
 {
-	// YOUR CODE HERE!
-	// First, find an empty process descriptor.  If there is no empty
-	//   process descriptor, return -1.  Remember not to use proc_array[0].
-	// Then, initialize that process descriptor as a running process
-	//   by copying the parent process's registers and stack into the
-	//   child.  Copying the registers is simple: they are stored in the
-	//   process descriptor in the 'p_registers' field.  Copying the stack
-	//   is a little more involved; see the copy_stack function, below.
-	//   The child process's registers will be equal to the parent's, with
-	//   two differences:
-	//   * reg_esp    The child process's stack pointer will point into
-	//                its stack, rather than the parent's.  copy_stack
-	//                should arrange this.
-	//   * ???????    There is one other difference.  What is it?  (Hint:
-	//                What should sys_fork() return to the child process?)
-	// You need to set one other process descriptor field as well.
-	// Finally, return the child's process ID to the parent.
-    int i;
-    process_t *child;
-    for (i = 1; i < NPROCS; i++) {   
-        if (proc_array[i].p_state == P_EMPTY) {
-            child = &proc_array[i];
-            break;
-        }
-    }
-    if (i == NPROCS + 1) {
-        return -1;
-    }
-    child->p_registers = parent->p_registers;
-    child->p_registers.reg_eax = 0;
-    copy_stack(child, parent);
-    child->p_state = P_RUNNABLE;
-    return i;
-   
+	process_t *child = process_alloc();
+
+	// Flush the parent's console output first, so the child does not
+	// inherit a copy of it and print it again.
+	console_flush(parent);
+	if (!child || !(child->p_pagedir = pagedir_fork(parent->p_pagedir)))
+		return -1;
+
+	child->p_registers = parent->p_registers;
+	child->p_registers.reg_eax = 0;
+	fpu_fork(child, parent);
+	return process_start(child, parent);
+}
+
+
+
+/*****************************************************************************
+ * do_spawn(parent, entry, arg)
+ *
+ *   Create a new child of 'parent' that calls the function at 'entry' with
+ *   argument 'arg', on an empty stack of its own.  Nothing of the parent's
+ *   is copied, so this costs the same whatever the parent's stack holds.
+ *   Returns the child's process ID, or -1 if it can't create a child.
+ *
+ *****************************************************************************/
+
+static pid_t
+do_spawn(process_t *parent, uintptr_t entry, uint32_t arg)
+{
+	process_t *child = process_alloc();
+
+	if (!child || !(child->p_pagedir = process_pagedir_create()))
+		return -1;
+	if (process_entry_init(child, entry, PROC_STACK_TOP, arg) < 0) {
+		pagedir_free(child->p_pagedir);
+		child->p_pagedir = NULL;
+		return -1;
+	}
+	return process_start(child, parent);
+}
+
+
+
+/*****************************************************************************
+ * do_thread_create(parent, fn, arg, stack_size)
+ *
+ *   Create a new thread that shares 'parent's page directory -- its whole
+ *   address space -- and calls the function at 'fn' with argument 'arg'.
+ *   Returns the thread's ID, or -1 if it can't create one.
+ *
+ *   Each thread's stack is carved out of the stack pool, the virtual
+ *   addresses [THREAD_STACK_START, THREAD_STACK_END), rather than sitting
+ *   at the fixed per-process stack: the first free run of 'stack_size'
+ *   bytes, plus a guard page below it, in the shared page directory.  The
+ *   stack is demand-zero, so unused stack costs no memory, and a thread
+ *   overflowing its stack hits the guard page and is killed instead of
+ *   scribbling over its neighbor's stack.  process_memory_free() returns
+ *   the stack to the pool when the thread exits.
+ *
+ *   A thread is recorded as a child of 'parent', and belongs to 'parent's
+ *   thread group (p_tgid), so that any thread in the group can join it.
+ *   The group's ID is its leader's pid, so the leader's descriptor is not
+ *   reused until every thread in the group has been reaped (see
+ *   process_reap()); otherwise a new process could get that pid and join
+ *   threads in another address space.
+ *
+ *****************************************************************************/
+
+static uintptr_t
+thread_stack_find(pagedirectory_t pagedir, size_t size)
+{
+	uintptr_t va, start = THREAD_STACK_START;
+	pte_t *pte;
+
+	for (va = THREAD_STACK_START; va < THREAD_STACK_END; va += PAGESIZE) {
+		if ((pte = virtual_memory_lookup(pagedir, va)) && *pte)
+			start = va + PAGESIZE;
+		else if (va + PAGESIZE - start == size + PAGESIZE)
+			return start + PAGESIZE;
+	}
+	return 0;
+}
+
+static pid_t
+do_thread_create(process_t *parent, uintptr_t fn, uint32_t arg,
+		 size_t stack_size)
+{
+	pagedirectory_t pagedir = parent->p_pagedir;
+	process_t *child = process_alloc();
+	uintptr_t base;
+
+	if (stack_size == 0)
+		stack_size = THREAD_STACK_DEFAULT;
+	if (!child || stack_size > THREAD_STACK_END - THREAD_STACK_START)
+		return -1;
+	stack_size = ROUNDUP(stack_size, PAGESIZE);
+	if (!(base = thread_stack_find(pagedir, stack_size)))
+		return -1;
+
+	if (virtual_memory_map(pagedir, base - PAGESIZE, 0, PAGESIZE,
+			       PTE_GUARD) < 0
+	    || virtual_memory_map(pagedir, base, 0, stack_size,
+				  PTE_U | PTE_W | PTE_ZERO) < 0) {
+		virtual_memory_unmap(pagedir, base - PAGESIZE,
+				     stack_size + PAGESIZE);
+		return -1;
+	}
+
+	child->p_pagedir = pagedir;
+	child->p_stack_base = base;
+	child->p_stack_top = base + stack_size;
+	if (process_entry_init(child, fn, child->p_stack_top, arg) < 0) {
+		virtual_memory_unmap(pagedir, base - PAGESIZE,
+				     stack_size + PAGESIZE);
+		child->p_pagedir = NULL;
+		return -1;
+	}
+	page_incref((physaddr_t) pagedir);
+	child->p_tgid = parent->p_tgid;
+	proc_array[child->p_tgid].p_tgrefs++;
+	return process_start(child, parent);
+}
+
+
+
+/*****************************************************************************
+ * process_alloc
+ *
+ *   Return an empty process descriptor for a new process, or NULL if there
+ *   is none, in constant time: this is the head of the free list.  The
+ *   descriptor stays on the free list until process_start(), so a caller
+ *   that fails to set up the process need not give it back.  The new
+ *   process is a thread group of its own.
+ *
+ * process_entry_init(proc, entry, sp, arg)
+ *
+ *   Set up 'proc's registers to call the function at 'entry' with argument
+ *   'arg', on the stack ending at 'sp' in 'proc's page directory.  The
+ *   kernel writes the initial stack frame -- 'arg', and a null return
+ *   address below it, so that returning from 'entry' faults -- through its
+ *   own mapping of the stack's top page.  Returns 0, or -1 if out of
+ *   memory.
+ *
+ * process_start(child, parent)
+ *
+ *   Record new process 'child', which has its page directory and registers
+ *   set up, as a child of 'parent', take it off the free list, give it
+ *   copies of 'parent's file descriptors, and mark it runnable.  Returns
+ *   its process ID.
+ *
+ * process_pagedir_create
+ *
+ *   Return a new page directory for a process, holding the kernel's
+ *   mappings, an empty console buffer, and an empty, demand-zero stack of
+ *   PROC_STACK_INITIAL bytes just below PROC_STACK_TOP, with a guard page
+ *   below that, or NULL if out of memory.
+ *
+ * process_stack_grow(proc, addr, esp)
+ *
+ *   Called on a page fault at 'addr' by 'proc', whose stack pointer was
+ *   'esp'.  If 'addr' lies within PROC_STACK_LIMIT bytes of PROC_STACK_TOP,
+ *   below the stack's guard page, and the access was to the guard page or
+ *   near the stack pointer, grow the stack down to cover 'addr', with a
+ *   new guard page below it.  (A function with a big stack frame may jump
+ *   past the guard page; the stack pointer test tells that from a stray
+ *   pointer.)  Returns 0 if the stack grew, -1 otherwise.  The new stack
+ *   pages are demand-zero, so growing costs no memory until they're used.
+ *
+ *   The guard page stays in place once the stack has reached its limit,
+ *   so running past the limit is reported as a stack overflow.
+ *
+ *****************************************************************************/
+
+static process_t *
+process_alloc(void)
+{
+	process_t *proc = free_procs;
+
+	if (proc) {
+		proc->p_tgid = proc->p_pid;
+		proc->p_tgrefs = 1;
+		proc->p_stack_base = 0;
+		proc->p_stack_top = 0;
+	}
+	return proc;
+}
+
+static int
+process_entry_init(process_t *proc, uintptr_t entry, uintptr_t sp,
+		   uint32_t arg)
+{
+	uint32_t *frame;
+	pte_t *pte;
+
+	sp -= 2 * sizeof(uint32_t);
+	if (virtual_memory_fault(proc->p_pagedir, sp, 1) < 0
+	    || !(pte = virtual_memory_lookup(proc->p_pagedir, sp)))
+		return -1;
+	frame = (uint32_t *) (PTE_ADDR(*pte) + (sp & (PAGESIZE - 1)));
+	frame[0] = 0;
+	frame[1] = arg;
+
+	special_registers_init(proc);
+	proc->p_registers.reg_eip = entry;
+	proc->p_registers.reg_esp = sp;
+	proc->p_fpu_used = 0;
+	return 0;
+}
+
+static pid_t
+process_start(process_t *child, process_t *parent)
+{
+	if (!(free_procs = child->p_free_next))
+		free_procs_tail = &free_procs;
+	child->p_free_next = NULL;
+	fd_fork(child, parent);
+
+	child->p_parent = parent;
+	child->p_children = NULL;
+	child->p_nchildren = 0;
+	child->p_zombies = NULL;
+	child->p_sibling = parent->p_children;
+	parent->p_children = child;
+	parent->p_nchildren++;
+	child->p_state = P_RUNNABLE;
+	return child->p_pid;
+}
+
+static pagedirectory_t
+process_pagedir_create(void)
+{
+	uintptr_t bottom = PROC_STACK_TOP - PROC_STACK_INITIAL;
+	pagedirectory_t pagedir = pagedir_create();
+	if (pagedir
+	    && (virtual_memory_map(pagedir, PROC_CONSOLEBUF, 0, PAGESIZE,
+				   PTE_U | PTE_W | PTE_ZERO) < 0
+		|| virtual_memory_map(pagedir, bottom, 0, PROC_STACK_INITIAL,
+				      PTE_U | PTE_W | PTE_ZERO) < 0
+		|| virtual_memory_map(pagedir, bottom - PAGESIZE, 0, PAGESIZE,
+				      PTE_GUARD) < 0)) {
+		pagedir_free(pagedir);
+		pagedir = NULL;
+	}
+	return pagedir;
+}
+
+// Bytes below the stack pointer a process may touch to grow its stack:
+// enough for 'pusha' and friends, which write before moving %esp.
+#define PROC_STACK_SLACK	64
+
+static int
+process_stack_grow(process_t *proc, uintptr_t addr, uintptr_t esp)
+{
+	uintptr_t va, bottom = ROUNDDOWN(addr, PAGESIZE);
+	pte_t *pte = NULL;
+
+	if (addr < PROC_STACK_TOP - PROC_STACK_LIMIT || addr >= PROC_STACK_TOP)
+		return -1;
+
+	// The guard page is the lowest page in use above 'addr'.
+	for (va = bottom; va < PROC_STACK_TOP; va += PAGESIZE)
+		if ((pte = virtual_memory_lookup(proc->p_pagedir, va)) && *pte)
+			break;
+	if (va == PROC_STACK_TOP || !(*pte & PTE_GUARD)
+	    || (va != bottom && addr + PROC_STACK_SLACK < esp))
+		return -1;
+
+	if (virtual_memory_map(proc->p_pagedir, bottom, 0,
+			       va + PAGESIZE - bottom,
+			       PTE_U | PTE_W | PTE_ZERO) < 0)
+		return -1;
+	// If the guard page can't be allocated, the stack grows anyway;
+	// running past it is then an ordinary page fault.
+	virtual_memory_map(proc->p_pagedir, bottom - PAGESIZE, 0, PAGESIZE,
+			   PTE_GUARD);
+	return 0;
+}
+
+
+
+/*****************************************************************************
+ * process_wait(proc)
+ *
+ *   Finish a sys_wait() or sys_thread_join() by the current process for
+ *   'proc'.  If 'proc' has exited, collect its exit status; otherwise the
+ *   current process blocks on 'proc's wait queue until it does (see
+ *   process_exit()).  Either way, this does not return.
+ *
+ * process_exit(proc, status)
+ *
+ *   Make 'proc' exit with exit status 'status'.  If processes are blocked
+ *   in sys_wait() on 'proc', each is woken exactly once: the oldest
+ *   collects the exit status, and the others get -1, as if they had
+ *   called sys_wait() later.  Otherwise, if 'proc's parent is blocked in
+ *   sys_waitany(), the parent collects the exit status.  Otherwise, if
+ *   'proc' has a parent, it stays a zombie, on its parent's zombie queue,
+ *   until someone waits for it.
+ *
+ *   'proc's own children are reparented to the kernel, which plays the
+ *   part of Unix's init: children that already exited are reaped at once,
+ *   and the others are reaped as soon as they exit, unless a process is
+ *   blocked in sys_wait() on them.  So zombies nobody can wait for never
+ *   fill up the process table.
+ *
+ * process_reap(proc)
+ *
+ *   Collect the exit status of zombie 'proc' and return it.  This frees
+ *   'proc's process descriptor, putting it back on the free list, and
+ *   removes it from its parent's lists of children.  If that leaves a
+ *   parent blocked in sys_waitany() with no children to wait for, the
+ *   parent's sys_waitany() returns -1.  A thread group leader's
+ *   descriptor, whose pid names the group, goes back on the free list only
+ *   after the group's last thread is reaped too.
+ *
+ *****************************************************************************/
+
+static void
+process_wait(process_t *proc)
+{
+	process_t **wp;
+
+	if (proc->p_state == P_ZOMBIE) {
+		current->p_registers.reg_eax = process_reap(proc);
+		run(current);
+	}
+
+	wp = &proc->p_waiters;
+	while (*wp)
+		wp = &(*wp)->p_wait_next;
+	*wp = current;
+	current->p_wait_next = NULL;
+	current->p_state = P_BLOCKED;
+	schedule();
+}
+
+static void
+process_exit(process_t *proc, int status)
+{
+	process_t *waiter = proc->p_waiters, *next, *child;
+	process_t *parent = proc->p_parent;
+
+	console_flush(proc);
+	fd_close_all(proc);
+	proc->p_state = P_ZOMBIE;
+	proc->p_exit_status = status;
+	process_memory_free(proc);
+
+	while ((child = proc->p_children)) {
+		proc->p_children = child->p_sibling;
+		child->p_parent = NULL;
+		child->p_sibling = NULL;
+		child->p_zombie_next = NULL;
+		if (child->p_state == P_ZOMBIE)
+			process_reap(child);
+	}
+	proc->p_zombies = NULL;
+	proc->p_nchildren = 0;
+
+	if (waiter)
+		waiter->p_registers.reg_eax = process_reap(proc);
+	else if (parent && parent->p_waitany) {
+		parent->p_waitany = 0;
+		parent->p_registers.reg_eax = proc->p_pid;
+		parent->p_registers.reg_ebx = process_reap(proc);
+		parent->p_state = P_RUNNABLE;
+	} else if (parent) {
+		proc->p_zombie_next = parent->p_zombies;
+		parent->p_zombies = proc;
+	} else
+		process_reap(proc);
+
+	for (; waiter; waiter = next) {
+		next = waiter->p_wait_next;
+		if (waiter != proc->p_waiters)
+			waiter->p_registers.reg_eax = -1;
+		waiter->p_wait_next = NULL;
+		waiter->p_state = P_RUNNABLE;
+	}
+	proc->p_waiters = NULL;
+}
+
+static int
+process_reap(process_t *proc)
+{
+	process_t *parent = proc->p_parent, **pp;
+	process_t *leader = &proc_array[proc->p_tgid];
+
+	if (parent) {
+		for (pp = &parent->p_zombies; *pp && *pp != proc;
+		     pp = &(*pp)->p_zombie_next)
+			/* do nothing */;
+		if (*pp)
+			*pp = proc->p_zombie_next;
+		for (pp = &parent->p_children; *pp != proc;
+		     pp = &(*pp)->p_sibling)
+			/* do nothing */;
+		*pp = proc->p_sibling;
+		if (--parent->p_nchildren == 0 && parent->p_waitany) {
+			parent->p_waitany = 0;
+			parent->p_registers.reg_eax = -1;
+			parent->p_state = P_RUNNABLE;
+		}
+	}
+	proc->p_parent = NULL;
+	proc->p_sibling = NULL;
+	proc->p_zombie_next = NULL;
+	proc->p_state = P_EMPTY;
+	// The leader of a thread group goes back on the free list only once
+	// its whole group is reaped.
+	if (--leader->p_tgrefs == 0) {
+		*free_procs_tail = leader;
+		free_procs_tail = &leader->p_free_next;
+	}
+	return proc->p_exit_status;
+}
+
+
+
+/*****************************************************************************
+ * process_memory_free
+ *
+ *   Free the page directory of exited process 'proc', its stack, and its
+ *   FPU state.  A thread returns its stack and guard page to the stack
+ *   pool; the page directory itself is freed only when the last process
+ *   or thread using it is gone.
+ *
+ *****************************************************************************/
+
+static void
+process_memory_free(process_t *proc)
+{
+	pagedirectory_t pagedir = proc->p_pagedir;
+
+	if (proc->p_stack_top)
+		virtual_memory_unmap(pagedir, proc->p_stack_base - PAGESIZE,
+				     proc->p_stack_top - proc->p_stack_base
+				     + PAGESIZE);
+	proc->p_pagedir = NULL;
+	fpu_release(proc);
+
+	if (page_refcount((physaddr_t) pagedir) > 1) {
+		page_decref((physaddr_t) pagedir);
+		return;
+	}
+	// Stop using the page directory before freeing it.
+	if (rcr3() == pagedir)
+		lcr3(kernel_pagedir);
+	pagedir_free(pagedir);
 }
+
+
+
+/*****************************************************************************
+ * console_flush(proc)
+ *
+ *   Copy the contents of 'proc's console buffer onto the screen at
+ *   'cursorpos', and empty the buffer.  The kernel reads the buffer through
+ *   its physical address, so this works whichever page directory is
+ *   loaded.  Since the kernel is never interrupted, the whole buffer lands
+ *   on the screen contiguously, whatever other processes print.
+ *
+ *****************************************************************************/
+
 static void
-copy_stack(process_t *dest, process_t *src)
+console_flush(process_t *proc)
+{
+	pte_t *pte = virtual_memory_lookup(proc->p_pagedir, PROC_CONSOLEBUF);
+	consolebuf_t *cb;
+
+	// A page that isn't present yet was never written, so it's empty.
+	if (!pte || !(*pte & PTE_P)
+	    || ((consolebuf_t *) PTE_ADDR(*pte))->cb_len == 0)
+		return;
+
+	// Emptying the buffer writes it: unshare it if it's copy-on-write.
+	if (virtual_memory_fault(proc->p_pagedir, PROC_CONSOLEBUF, 1) < 0)
+		return;
+	cb = (consolebuf_t *) PTE_ADDR(*pte);
+	cursorpos = console_write(cursorpos, cb->cb_cells,
+				  MIN(cb->cb_len, CONSOLEBUF_SIZE));
+	cb->cb_len = 0;
+}
+
+
+
+/*****************************************************************************
+ * kerneldata_update
+ *
+ *   Called by run() just before 'proc' runs.  Refreshes the kernel data
+ *   page (see const.h) with the system's and 'proc's current state.
+ *
+ *   The tick count is the cycle counter's progress since boot divided by
+ *   kd_tsc_khz.  There is no libgcc for 64-bit division, so this uses
+ *   'divl', which divides %edx:%eax by 32 bits as long as %edx is less
+ *   than the divisor: for about 2^32 milliseconds (50 days).
+ *
+ *****************************************************************************/
+
+void
+kerneldata_update(process_t *proc)
 {
-    uint32_t src_stack_bottom, src_stack_top;
-    uint32_t dest_stack_bottom, dest_stack_top;
-
-    // YOUR CODE HERE!
-    // This function copies the 'src' process's stack into the 'dest'
-    // process's stack region.  Then it sets 'dest's stack pointer to
-    // correspond to 'src's stack pointer.
-
-    // For example, assume that 'src->p_pid == 1' and 'dest->p_pid == 2'.
-    // Then this code should change this memory setup:
-
-    //        Miniproc 1 Stack    Miniproc 2 Stack
-    //   /--+-------------------+-------------------+--/
-    //      |        ABXLQPAOSRJ|                   |
-    //   /--+-------------------+-------------------+--/
-    //  0x280000     ^      0x2C0000            0x300000
-    //               |
-    //    src->p_registers.reg_esp
-    //         == 0x29A4CC
-
-    // into this:
-    //
-    //        Miniproc 1 Stack    Miniproc 2 Stack
-    //   /--+-------------------+-------------------+--/
-    //      |        ABXLQPAOSRJ|        ABXLQPAOSRJ|   //   /--+-------------------+-------------------+--/
-    //   /--+-------------------+-------------------+--/
-    //  0x280000     ^      0x2C0000     ^      0x300000
-    //               |                   |
-    //    src->p_registers.reg_esp   dest->p_registers.reg_esp
-    //         == 0x29A4CC           == 0x2DA4CC
-    //                               == 0x300000 + (0x29A4CC - 0x2C0000)
-    //
-    // You may implement this however you like, but we found it easiest
-    // to express with variables that locate the bottom and top of each
-    // stack.  In our examples, the variables would equal:
-    //
-    //   /--+-------------------+-------------------+--/
-    //      |        ABXLQPAOSRJ|        ABXLQPAOSRJ|
-    //   /--+-------------------+-------------------+--/
-    //  0x280000     ^      0x2C0000     ^      0x300000
-    //               |          ^        |          ^
-    //        src_stack_bottom  | dest_stack_bottom |
-    //          == 0x29A4CC     |   == 0x2DA4CC     |
-    //                    src_stack_top      dest_stack_top
-    //                     == 0x2C0000         == 0x300000
-
-	// Your job is to figure out how to calculate these variables,
-	// and then how to actually copy the stack.  (Hint: use memcpy.)
-	// We have done one for you.
-
-	// YOUR CODE HERE!
-
-	src_stack_top = PROC1_STACK_ADDR + src->p_pid * PROC_STACK_SIZE; /* YOUR CODE HERE */;
-	src_stack_bottom = src->p_registers.reg_esp;
-	dest_stack_top = src_stack_top + (dest->p_pid - src->p_pid) * PROC_STACK_SIZE;/* YOUR CODE HERE */;
-	dest_stack_bottom = dest_stack_top - (src_stack_top - src_stack_bottom); /* YOUR CODE HERE: calculate based on the
-				 other variables */;
-	// YOUR CODE HERE: memcpy the stack and set dest->p_registers.reg_esp
-    memcpy((void*)src_stack_bottom, (void*)dest_stack_bottom, (src_stack_top - src_stack_bottom)); 
-    dest->p_registers.reg_esp = dest_stack_bottom;
+	uint64_t cycles = read_cycle_counter() - boot_cycles;
+	uint32_t hi = cycles >> 32, lo = (uint32_t) cycles;
+	uint32_t khz = kerneldata.kd_tsc_khz;
+	pid_t i;
+	int nrunnable = 0;
+
+	for (i = 1; i < NPROCS; i++)
+		nrunnable += (proc_array[i].p_state == P_RUNNABLE);
+
+	if (khz > hi) {
+		asm("divl %2" : "+a" (lo), "+d" (hi) : "rm" (khz) : "cc");
+		kerneldata.kd_ticks = lo;
+	}
+	kerneldata.kd_pid = proc->p_pid;
+	kerneldata.kd_nrunnable = nrunnable;
+	kerneldata.kd_nruns = ++proc->p_nruns;
 }
 
 
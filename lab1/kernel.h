@@ -8,11 +8,34 @@ typedef enum procstate {
 	P_EMPTY = 0,			// The process table entry is empty
 					// (i.e. this is not a process)
 	P_RUNNABLE,			// This process is runnable
-	P_BLOCKED,			// This process is blocked
+	P_BLOCKED,			// This process is blocked (in
+					// sys_wait(), or on a pipe)
 	P_ZOMBIE			// This process has exited, but no one
 					// has called sys_wait() yet
 } procstate_t;
 
+// Pipe type (see k-pipe.c)
+#define PIPE_SIZE		4096	// Bytes in a pipe's ring buffer
+#define NPIPES			8	// Pipes in the system
+
+typedef struct pipe {
+	uint8_t pp_buf[PIPE_SIZE];	// Ring buffer
+	uint32_t pp_head;		// Index of the oldest unread byte
+	uint32_t pp_len;		// Number of unread bytes
+	int pp_nreaders;		// Open read ends (0 and 0: pipe free)
+	int pp_nwriters;		// Open write ends
+	struct process *pp_readers;	// Processes blocked reading, and
+	struct process *pp_writers;	// writing, linked through p_wait_next
+} pipe_t;
+
+// File descriptor type: each process has PROC_NFDS of them
+#define PROC_NFDS		8
+
+typedef struct filedesc {
+	pipe_t *fd_pipe;		// Open pipe, or NULL if not open
+	bool_t fd_write;		// Write end?
+} filedesc_t;
+
 // Process descriptor type
 typedef struct process {
 	pid_t p_pid;			// Process ID
@@ -20,24 +43,124 @@ typedef struct process {
 	registers_t p_registers;	// Current process state: registers,
 					// stack location, EIP, etc.
 					// 'registers_t' defined in x86.h
+	pagedirectory_t p_pagedir;	// Process's page directory
+
 	procstate_t p_state;		// Process state; see above
 	int p_exit_status;		// Process's exit status (if it has
 					// exited and p_state == P_ZOMBIE)
+	uint32_t p_nruns;		// Number of times run() has run it
+
+	struct process *p_waiters;	// Processes blocked in sys_wait() on
+					// this process, oldest first
+	struct process *p_wait_next;	// Next process in the same wait queue
+					// (or pipe's queue of blocked
+					// processes)
+
+	struct process *p_parent;	// Process that forked this one (NULL
+					// if none, or if it has exited)
+	struct process *p_children;	// Children not yet waited for
+	struct process *p_sibling;	// Next in the parent's p_children
+	int p_nchildren;		// Length of p_children
+	struct process *p_zombies;	// Exited children not yet waited for,
+					// newest first
+	struct process *p_zombie_next;	// Next in the parent's p_zombies
+	bool_t p_waitany;		// Blocked in sys_waitany()?
+	struct process *p_free_next;	// Next in the free list (P_EMPTY)
+
+	pid_t p_tgid;			// Thread group: ID of the process that
+					// created this address space
+	int p_tgrefs;			// In a group's leader: group members,
+					// itself included, not yet reaped
+	uintptr_t p_stack_base;		// A thread's stack; both 0 if this is
+	uintptr_t p_stack_top;		// not a thread
+
+	filedesc_t p_fds[PROC_NFDS];	// Open file descriptors
+
+	fpustate_t p_fpu;		// Saved FPU state (see fpu_init())
+	bool_t p_fpu_used;		// Has the process used the FPU?
 } process_t;
 
 
 // Top of the kernel stack
 #define KERNEL_STACK_TOP	0x80000
 
+// The page fault exception number
+#define INT_PAGEFAULT		14
+
+// The device-not-available exception number: a floating-point or SSE
+// instruction ran with CR0_TS set (see fpu_init())
+#define INT_FPU			7
+
+// Physical pages for page tables and stacks come from this pool
+#define FRAME_POOL_START	0x280000
+#define FRAME_POOL_END		0x400000
+
+// Each process's stack grows down from PROC_STACK_TOP.  It starts out
+// PROC_STACK_INITIAL bytes long, with a guard page below it, and grows on
+// demand (see process_stack_grow()) up to PROC_STACK_LIMIT bytes.  Build
+// with DEFS=-DPROC_STACK_LIMIT=<bytes> to change the limit.  The process's
+// console buffer page (see const.h) sits just above the stack.
+#define PROC_STACK_TOP		0x7FF000
+#define PROC_CONSOLEBUF		0x7FF000
+#define PROC_STACK_INITIAL	0x002000
+#ifndef PROC_STACK_LIMIT
+#define PROC_STACK_LIMIT	0x040000
+#endif
+
+// Threads' stacks (see sys_thread_create()) are carved out of the virtual
+// addresses from THREAD_STACK_START to THREAD_STACK_END, each with a guard
+// page below it.  A thread asking for no particular stack size gets
+// THREAD_STACK_DEFAULT bytes.
+#define THREAD_STACK_START	0x1000000
+#define THREAD_STACK_END	0x2000000
+#define THREAD_STACK_DEFAULT	0x4000
+
+// Software page table entry bits, in PTE_AVAIL
+#define PTE_COW			0x200		// Copy-on-write: shared, and
+						// writable once copied
+#define PTE_ZERO		0x400		// Not present yet: demand-zero
+#define PTE_GUARD		0x800		// Never present: guard page
+
 // Functions defined in kernel.c
 void interrupt(registers_t *reg);
 void schedule(void);
+void kerneldata_update(process_t *proc);
 
 // Functions defined in x86.c
 void segments_init();
 void special_registers_init(process_t *proc);
+void fpu_init(void);
+void fpu_trap(void);
+void fpu_release(process_t *proc);
+void fpu_fork(process_t *child, process_t *parent);
 void console_clear(void);
 int console_read_digit(void);
+uint32_t cycle_counter_calibrate(void);
+void virtual_memory_init(void);
+pagedirectory_t pagedir_create(void);
+pagedirectory_t pagedir_fork(pagedirectory_t pagedir);
+void pagedir_free(pagedirectory_t pagedir);
+int virtual_memory_map(pagedirectory_t pagedir, uintptr_t va, physaddr_t pa,
+		       size_t size, int perm);
+void virtual_memory_unmap(pagedirectory_t pagedir, uintptr_t va, size_t size);
+pte_t *virtual_memory_lookup(pagedirectory_t pagedir, uintptr_t va);
+int virtual_memory_fault(pagedirectory_t pagedir, uintptr_t va, bool_t write);
+extern pagedirectory_t kernel_pagedir;
+// Functions defined in k-palloc.c
+void page_alloc_init(void);
+physaddr_t page_alloc(void);
+void page_incref(physaddr_t pa);
+void page_decref(physaddr_t pa);
+int page_refcount(physaddr_t pa);
+int page_alloc_free_pages(void);
+// Functions defined in k-pipe.c
+#define PIPE_BLOCKED		(-2)
+int pipe_create(process_t *proc);
+ssize_t pipe_read(process_t *proc, int fd, uintptr_t buf, size_t n);
+ssize_t pipe_write(process_t *proc, int fd, uintptr_t buf, size_t n);
+int fd_close(process_t *proc, int fd);
+void fd_fork(process_t *child, process_t *parent);
+void fd_close_all(process_t *proc);
 // Function defined in k-loader.c
 void program_loader(int programnumber, uint32_t *entry_point);
 
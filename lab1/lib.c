@@ -11,15 +11,38 @@
 /*****************************************************************************
  * memcpy, memmove, memset, and strlen
  *
- *   We must provide our own implementations of these basic functions. */
+ *   We must provide our own implementations of these basic functions.
+ *
+ *   Large copies and fills move 4-byte words with the string instructions
+ *   'rep movsl' and 'rep stosl', after a few single bytes to align the
+ *   destination.  strlen() examines a word at a time, using the fact that
+ *   (w - 0x01010101) & ~w & 0x80808080 is nonzero exactly when one of w's
+ *   bytes is zero.  The kernel clears the direction flag on every entry
+ *   (see k-int.S), so the string instructions count upwards. */
+
+// Below this many bytes, aligning and then moving words isn't worth it.
+#define WORDWISE_MIN		16
+
+// A word that may alias any other type
+typedef uint32_t __attribute__((may_alias)) memword_t;
 
 void *
 memcpy(void *dst, const void *src, size_t n)
 {
 	const char *s = (const char *) src;
 	char *d = (char *) dst;
-	while (n-- > 0)
-		*d++ = *s++;
+	if (n >= WORDWISE_MIN) {
+		size_t head = -(uintptr_t) d & 3, words;
+		n -= head;
+		asm volatile("rep movsb"
+			     : "+D" (d), "+S" (s), "+c" (head) : : "memory");
+		words = n / 4;
+		n &= 3;
+		asm volatile("rep movsl"
+			     : "+D" (d), "+S" (s), "+c" (words) : : "memory");
+	}
+	asm volatile("rep movsb"
+		     : "+D" (d), "+S" (s), "+c" (n) : : "memory");
 	return dst;
 }
 
@@ -28,13 +51,26 @@ memmove(void *dst, const void *src, size_t n)
 {
 	const char *s = (const char *) src;
 	char *d = (char *) dst;
-	if (s < d && s + n > d) {
-		s += n, d += n;
-		while (n-- > 0)
+	if (!(s < d && s + n > d))
+		return memcpy(dst, src, n);
+
+	// The destination overlaps the end of the source: copy backwards,
+	// aligning the end of the destination.
+	s += n, d += n;
+	if (n >= WORDWISE_MIN) {
+		size_t words;
+		for (; (uintptr_t) d & 3; --n)
 			*--d = *--s;
-	} else
-		while (n-- > 0)
-			*d++ = *s++;
+		words = n / 4;
+		n &= 3;
+		s -= 4, d -= 4;
+		asm volatile("std\n\trep movsl\n\tcld"
+			     : "+D" (d), "+S" (s), "+c" (words)
+			     : : "cc", "memory");
+		s += 4, d += 4;
+	}
+	while (n-- > 0)
+		*--d = *--s;
 	return dst;
 }
 
@@ -42,18 +78,39 @@ void *
 memset(void *v, int c, size_t n)
 {
 	char *p = (char *) v;
-	while (n-- > 0)
-		*p++ = c;
+	if (n >= WORDWISE_MIN) {
+		uint32_t word = (uint8_t) c * 0x01010101U;
+		size_t head = -(uintptr_t) p & 3, words;
+		n -= head;
+		asm volatile("rep stosb"
+			     : "+D" (p), "+c" (head) : "a" (word) : "memory");
+		words = n / 4;
+		n &= 3;
+		asm volatile("rep stosl"
+			     : "+D" (p), "+c" (words) : "a" (word) : "memory");
+	}
+	asm volatile("rep stosb"
+		     : "+D" (p), "+c" (n) : "a" (c) : "memory");
 	return v;
 }
 
 size_t
 strlen(const char *s)
 {
-	size_t n;
-	for (n = 0; *s != '\0'; ++s)
-		++n;
-	return n;
+	const char *p = s;
+	const memword_t *w;
+
+	// Aligned words never straddle a page boundary, so reading a whole
+	// word that holds the terminator can't fault.
+	for (; (uintptr_t) p & 3; ++p)
+		if (*p == '\0')
+			return p - s;
+	for (w = (const memword_t *) p;
+	     !((*w - 0x01010101U) & ~*w & 0x80808080U); ++w)
+		/* do nothing */;
+	for (p = (const char *) w; *p != '\0'; ++p)
+		/* do nothing */;
+	return p - s;
 }
 
 size_t
@@ -67,9 +124,10 @@ strnlen(const char *s, size_t maxlen)
 
 
 /*****************************************************************************
- * console_vprintf
+ * printer_vprintf, console_vprintf
  *
- *   Print a message onto the console, starting at the given cursor position. */
+ *   Print a message through a printer, or onto the console starting at the
+ *   given cursor position. */
 
 static uint16_t *
 console_putc(uint16_t *cursor, unsigned char c, int color)
@@ -85,6 +143,18 @@ console_putc(uint16_t *cursor, unsigned char c, int color)
 	return cursor;
 }
 
+typedef struct console_printer {
+	printer_t p;
+	uint16_t *cursor;
+} console_printer_t;
+
+static void
+console_printer_putc(printer_t *p, unsigned char c, int color)
+{
+	console_printer_t *cp = (console_printer_t *) p;
+	cp->cursor = console_putc(cp->cursor, c, color);
+}
+
 static const char upper_digits[] = "0123456789ABCDEF";
 static const char lower_digits[] = "0123456789abcdef";
 
@@ -108,8 +178,8 @@ fill_numbuf(char *numbuf_end, uint32_t val, int base, const char *digits,
 #define FLAG_PLUSPOSITIVE	(1<<4)
 static const char flag_chars[] = "#0- +";
 
-uint16_t *
-console_vprintf(uint16_t *cursor, int color, const char *format, va_list val)
+void
+printer_vprintf(printer_t *p, int color, const char *format, va_list val)
 {
 	int flags, width, zeros, precision, negative, numeric, len;
 #define NUMBUFSIZ 20
@@ -118,7 +188,7 @@ console_vprintf(uint16_t *cursor, int color, const char *format, va_list val)
 
 	for (; *format; ++format) {
 		if (*format != '%') {
-			cursor = console_putc(cursor, *format, color);
+			p->putc(p, *format, color);
 			continue;
 		}
 
@@ -231,19 +301,27 @@ console_vprintf(uint16_t *cursor, int color, const char *format, va_list val)
 			zeros = 0;
 		width -= len + zeros + !!negative;
 		for (; !(flags & FLAG_LEFTJUSTIFY) && width > 0; --width)
-			cursor = console_putc(cursor, ' ', color);
+			p->putc(p, ' ', color);
 		if (negative)
-			cursor = console_putc(cursor, negative, color);
+			p->putc(p, negative, color);
 		for (; zeros > 0; --zeros)
-			cursor = console_putc(cursor, '0', color);
+			p->putc(p, '0', color);
 		for (; len > 0; ++data, --len)
-			cursor = console_putc(cursor, *data, color);
+			p->putc(p, *data, color);
 		for (; width > 0; --width)
-			cursor = console_putc(cursor, ' ', color);
+			p->putc(p, ' ', color);
 	done: ;
 	}
+}
 
-	return cursor;
+uint16_t *
+console_vprintf(uint16_t *cursor, int color, const char *format, va_list val)
+{
+	console_printer_t cp;
+	cp.p.putc = console_printer_putc;
+	cp.cursor = cursor;
+	printer_vprintf(&cp.p, color, format, val);
+	return cp.cursor;
 }
 
 uint16_t *
@@ -255,3 +333,18 @@ console_printf(uint16_t *cursor, int color, const char *format, ...)
 	va_end(val);
 	return cursor;
 }
+
+
+/*****************************************************************************
+ * console_write
+ *
+ *   Copy console cells onto the console, starting at the given cursor
+ *   position. */
+
+uint16_t *
+console_write(uint16_t *cursor, const uint16_t *cells, size_t n)
+{
+	for (; n > 0; ++cells, --n)
+		cursor = console_putc(cursor, *cells & 0xFF, *cells & 0xFF00);
+	return cursor;
+}
@@ -57,4 +57,28 @@ uint16_t *console_printf(uint16_t *cursor, int color,
 uint16_t *console_vprintf(uint16_t *cursor, int color,
 			  const char *format, va_list val);
 
+/*****************************************************************************
+ * printer_vprintf(printer, color, format, val)
+ *
+ *   The engine behind console_vprintf(): formats like console_printf(), but
+ *   hands each character and its color to 'printer->putc' instead of
+ *   writing console memory.  Embed a printer_t at the start of a larger
+ *   structure to give 'putc' state of its own.
+ *
+ * console_write(cursor, cells, n)
+ *
+ *   Copy 'n' console cells (characters with their colors, as stored in
+ *   console memory) onto the console starting at 'cursor', treating a
+ *   '\n' character the way console_printf() does.  Returns the final
+ *   cursor position. */
+
+typedef struct printer printer_t;
+struct printer {
+	void (*putc)(printer_t *p, unsigned char c, int color);
+};
+
+void printer_vprintf(printer_t *p, int color, const char *format, va_list val);
+
+uint16_t *console_write(uint16_t *cursor, const uint16_t *cells, size_t n);
+
 #endif /* !WEENSYOS_LIB_H */
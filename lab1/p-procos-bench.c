@@ -0,0 +1,206 @@
+#include "process.h"
+#include "lib.h"
+#include "x86.h"
+#include "uthread.h"
+
+/*****************************************************************************
+ * p-procos-bench
+ *
+ *   This application measures how fast miniprocos creates, switches, and
+ *   reaps processes, how fast a pipe moves data between two processes, and
+ *   how fast two user-level threads (see uthread.h) switch back and forth
+ *   over channels, using the cycle counter (see read_cycle_counter()).
+ *   Each test prints its cost in cycles per operation and the matching
+ *   number of operations per second.
+ *
+ *****************************************************************************/
+
+#define BENCH_PROCESSES		200	// fork or spawn + exit + wait cycles
+#define BENCH_YIELDS		1000	// yields by each of two processes
+#define BENCH_GETPIDS		10000
+#define BENCH_PIPE_KB		4096	// kilobytes through the pipe
+#define BENCH_PIPE_CHUNK	4096	// bytes per sys_read or sys_write
+#define BENCH_UTHREAD_ROUNDS	10000	// ping-pong round trips
+
+static uint32_t div64(uint64_t n, uint32_t d);
+static void report(const char *what, uint64_t start, uint32_t nops);
+static void spawned(void *arg);
+static void benchmark_pipe(void);
+static void benchmark_uthread(void);
+
+void
+pmain(void)
+{
+	uint64_t start;
+	pid_t p;
+	int i;
+
+	app_printf("MiniprocOS benchmarks (cycle counter %u kHz)\n\n",
+		   kerneldata.kd_tsc_khz);
+
+	start = read_cycle_counter();
+	for (i = 0; i < BENCH_GETPIDS; i++)
+		(void) sys_getpid();
+	report("getpid (kernel data page)", start, BENCH_GETPIDS);
+
+	start = read_cycle_counter();
+	for (i = 0; i < BENCH_GETPIDS; i++)
+		(void) sys_getpid_trap();
+	report("getpid (system call)", start, BENCH_GETPIDS);
+
+	start = read_cycle_counter();
+	for (i = 0; i < BENCH_PROCESSES; i++) {
+		if ((p = sys_fork()) == 0)
+			sys_exit(0);
+		if (p < 0 || sys_wait(p) != 0) {
+			app_printf("fork failed!\n");
+			sys_exit(1);
+		}
+	}
+	report("fork + exit + wait", start, BENCH_PROCESSES);
+
+	start = read_cycle_counter();
+	for (i = 0; i < BENCH_PROCESSES; i++) {
+		if ((p = sys_spawn(spawned, NULL)) < 0 || sys_wait(p) != 0) {
+			app_printf("spawn failed!\n");
+			sys_exit(1);
+		}
+	}
+	report("spawn + exit + wait", start, BENCH_PROCESSES);
+
+	// With two runnable processes, every sys_yield() switches to the
+	// other one.
+	if ((p = sys_fork()) == 0) {
+		for (i = 0; i < BENCH_YIELDS; i++)
+			sys_yield();
+		sys_exit(0);
+	}
+	start = read_cycle_counter();
+	for (i = 0; i < BENCH_YIELDS; i++)
+		sys_yield();
+	report("yield (process switch)", start, 2 * BENCH_YIELDS);
+	sys_wait(p);
+
+	benchmark_pipe();
+	benchmark_uthread();
+	sys_exit(0);
+}
+
+// A child writes BENCH_PIPE_KB kilobytes into a pipe, BENCH_PIPE_CHUNK
+// bytes at a time, while the parent reads them out.
+static void
+benchmark_pipe(void)
+{
+	static const uint32_t total = BENCH_PIPE_KB * 1024;
+	uint8_t buf[BENCH_PIPE_CHUNK];
+	uint32_t moved = 0, cycles, khz = kerneldata.kd_tsc_khz;
+	uint64_t start;
+	ssize_t n;
+	int fds[2] = { -1, -1 };
+	pid_t p;
+
+	if (sys_pipe(fds) < 0) {
+		app_printf("pipe failed!\n");
+		sys_exit(1);
+	}
+	if ((p = sys_fork()) < 0) {
+		app_printf("fork failed!\n");
+		sys_exit(1);
+	} else if (p == 0) {
+		sys_close(fds[0]);
+		memset(buf, 'x', sizeof(buf));
+		while (moved < total
+		       && (n = sys_write(fds[1], buf,
+					 MIN(sizeof(buf), total - moved))) > 0)
+			moved += n;
+		sys_exit(moved == total ? 0 : 1);
+	}
+
+	sys_close(fds[1]);
+	start = read_cycle_counter();
+	while ((n = sys_read(fds[0], buf, sizeof(buf))) > 0)
+		moved += n;
+	cycles = div64(read_cycle_counter() - start, BENCH_PIPE_KB);
+	sys_close(fds[0]);
+	if (sys_wait(p) != 0 || moved != total) {
+		app_printf("pipe lost data!\n");
+		sys_exit(1);
+	}
+
+	// 'khz / cycles' is kilobytes per millisecond; scale to MB/s.
+	if (cycles == 0)
+		cycles = 1;
+	app_printf("%-26s %8u cycles/KB %5u MB/s\n", "pipe (4 KB transfers)",
+		   cycles, khz / cycles * 1000 / 1024
+		   + khz % cycles * 1000 / 1024 / cycles);
+}
+
+// Thread 0 sends BENCH_UTHREAD_ROUNDS values on 'ping', and a second
+// thread echoes each one back on 'pong'.  The channels hold one value, so
+// every round trip blocks each thread once: two thread switches.
+static uthread_chan_t ping, pong;
+static uint32_t ping_buf[1], pong_buf[1];
+
+static void
+ponger(void *arg)
+{
+	int i;
+	for (i = 0; i < BENCH_UTHREAD_ROUNDS; i++)
+		uthread_chan_send(&pong, uthread_chan_recv(&ping));
+}
+
+static void
+benchmark_uthread(void)
+{
+	uint64_t start;
+	uint32_t i;
+
+	uthread_chan_init(&ping, ping_buf, 1);
+	uthread_chan_init(&pong, pong_buf, 1);
+	if (uthread_create(ponger, NULL) < 0) {
+		app_printf("uthread_create failed!\n");
+		sys_exit(1);
+	}
+
+	start = read_cycle_counter();
+	for (i = 0; i < BENCH_UTHREAD_ROUNDS; i++) {
+		uthread_chan_send(&ping, i);
+		if (uthread_chan_recv(&pong) != i) {
+			app_printf("uthread channel lost data!\n");
+			sys_exit(1);
+		}
+	}
+	report("uthread switch (channel)", start, 2 * BENCH_UTHREAD_ROUNDS);
+}
+
+static void
+spawned(void *arg)
+{
+	sys_exit(0);
+}
+
+// Return 'n / d'.  C's 64-bit division would need libgcc, so use 'divl',
+// which divides %edx:%eax by 32 bits as long as %edx < 'd'.  A quotient
+// too big for 32 bits comes back as 0xFFFFFFFF.
+static uint32_t
+div64(uint64_t n, uint32_t d)
+{
+	uint32_t hi = n >> 32, lo = (uint32_t) n;
+	if (hi >= d)
+		return 0xFFFFFFFF;
+	asm("divl %2" : "+a" (lo), "+d" (hi) : "rm" (d) : "cc");
+	return lo;
+}
+
+// Print the cost of 'nops' operations that started at cycle 'start'.
+static void
+report(const char *what, uint64_t start, uint32_t nops)
+{
+	uint32_t cycles = div64(read_cycle_counter() - start, nops);
+	uint32_t khz = kerneldata.kd_tsc_khz, per_sec;
+
+	if (cycles == 0)
+		cycles = 1;
+	per_sec = khz / cycles * 1000 + khz % cycles * 1000 / cycles;
+	app_printf("%-26s %8u cycles %10u/s\n", what, cycles, per_sec);
+}
@@ -19,14 +19,15 @@
 
 
 /*****************************************************************************
- * sys_getpid
+ * sys_getpid_trap
  *
- *   Returns the current process's process ID.
+ *   Returns the current process's process ID, by asking the kernel.
+ *   (Applications normally use the faster sys_getpid(), below.)
  *
  *****************************************************************************/
 
 static inline pid_t
-sys_getpid(void)
+sys_getpid_trap(void)
 {
 	// We call a system call using the 'int' instruction.  This causes a
 	// software interrupt, which is sometimes called a "trap".
@@ -54,6 +55,23 @@ sys_getpid(void)
 }
 
 
+/*****************************************************************************
+ * sys_getpid
+ *
+ *   Returns the current process's process ID.
+ *   This does not actually trap into the kernel.  The kernel keeps the
+ *   running process's ID in the kernel data page (see const.h), so
+ *   sys_getpid() can simply read it from there.
+ *
+ *****************************************************************************/
+
+static inline pid_t
+sys_getpid(void)
+{
+	return kerneldata.kd_pid;
+}
+
+
 /*****************************************************************************
  * sys_fork
  *
@@ -69,7 +87,7 @@ sys_getpid(void)
 static inline pid_t
 sys_fork(void)
 {
-	// This system call follows the same pattern as sys_getpid().
+	// This system call follows the same pattern as sys_getpid_trap().
 
 	pid_t result;
 	asm volatile("int %1\n"
@@ -138,14 +156,18 @@ sys_exit(int status)
  * sys_wait(pid)
  *
  *   Wait until the process with ID 'pid' exits, then return that
- *   process's exit status.
+ *   process's exit status.  The caller blocks, using no CPU time, until
+ *   'pid' exits.
  *   sys_wait(pid) will only return successfully *once* for a given process
  *   'pid'.  If two processes call sys_wait(pid) for the same pid, only one
- *   of them will return the actual exit status.
+ *   of them (the first to call) will return the actual exit status; the
+ *   other gets -1.
  *   After that point the process ID might be reused.
+ *   If the process's parent exited before it, the kernel reaps it as soon
+ *   as it exits unless someone is already blocked in sys_wait(pid), so
+ *   a later sys_wait(pid) returns -1.
  *
  *   Returns -1 if 'pid' does not exist, or equals the current process's ID.
- *   Returns WAIT_TRYAGAIN == -2 if 'pid' has not yet exited.
  *
  *****************************************************************************/
 
@@ -163,21 +185,269 @@ sys_wait(pid_t pid)
 
 
 
+/*****************************************************************************
+ * sys_waitany(status)
+ *
+ *   Wait until any child of the current process (a process it created
+ *   with sys_fork()) has exited, then return that child's process ID and
+ *   store its exit status in '*status' (unless 'status' is NULL).  If a
+ *   child has already exited, this returns at once; otherwise the caller
+ *   blocks until one does.  Like sys_wait(), this collects the child's
+ *   exit status, so each child is returned once.
+ *
+ *   Returns -1 if the current process has no children left to wait for.
+ *
+ *****************************************************************************/
+
+static inline pid_t
+sys_waitany(int *status)
+{
+	pid_t pid;
+	int child_status;
+	asm volatile("int %2\n"
+		     : "=a" (pid), "=b" (child_status)
+		     : "i" (INT_SYS_WAITANY)
+		     : "cc", "memory");
+	if (status && pid > 0)
+		*status = child_status;
+	return pid;
+}
+
+
+
+/*****************************************************************************
+ * sys_spawn(entry, arg)
+ *
+ *   Create a new child process that runs 'entry(arg)' on a fresh, empty
+ *   stack.  Unlike sys_fork(), the child shares none of the parent's stack,
+ *   so creating it takes the same time however deep the parent's stack is.
+ *   The child is a child like any other: the parent can sys_wait() or
+ *   sys_waitany() for it.  'entry' must not return; it should finish with
+ *   sys_exit().
+ *
+ *   Returns the child's process ID, or -1 if no process could be created.
+ *
+ *****************************************************************************/
+
+static inline pid_t
+sys_spawn(void (*entry)(void *), void *arg)
+{
+	pid_t result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_SPAWN),
+		       "a" (entry),
+		       "b" (arg)
+		     : "cc", "memory");
+	return result;
+}
+
+
+
+/*****************************************************************************
+ * sys_thread_create(fn, arg, stack_size)
+ *
+ *   Create a new thread that runs 'fn(arg)' in the current process's
+ *   address space: it sees the same stacks and memory, not copies.  The
+ *   thread gets its own stack of at least 'stack_size' bytes (or a
+ *   default size, if 'stack_size' is 0) from the kernel's thread stack
+ *   pool, with an unmapped guard page below it, so a thread that overflows
+ *   its stack dies instead of corrupting another's.  'fn' must not return;
+ *   it should finish with sys_exit(), whose status sys_thread_join()
+ *   returns.
+ *
+ *   Returns the new thread's ID, or -1 if no thread could be created.
+ *
+ *****************************************************************************/
+
+static inline pid_t
+sys_thread_create(void (*fn)(void *), void *arg, size_t stack_size)
+{
+	pid_t result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_THREAD_CREATE),
+		       "a" (fn),
+		       "b" (arg),
+		       "c" (stack_size)
+		     : "cc", "memory");
+	return result;
+}
+
+
+
+/*****************************************************************************
+ * sys_thread_join(tid)
+ *
+ *   Wait for thread 'tid' to exit, and return its exit status.  Only a
+ *   thread created by this process (or by another of its threads) can be
+ *   joined, and only once.
+ *
+ *   Returns -1 if 'tid' is not such a thread.
+ *
+ *****************************************************************************/
+
+static inline int
+sys_thread_join(pid_t tid)
+{
+	int status;
+	asm volatile("int %1\n"
+		     : "=a" (status)
+		     : "i" (INT_SYS_THREAD_JOIN),
+		       "a" (tid)
+		     : "cc", "memory");
+	return status;
+}
+
+
+
+/*****************************************************************************
+ * sys_pipe(fds)
+ *
+ *   Create a pipe: a kernel buffer that one process can write bytes into
+ *   and another read them out of, in order.  Stores a file descriptor for
+ *   reading the pipe in fds[0], and one for writing it in fds[1].  Child
+ *   processes and threads inherit their parent's file descriptors, so
+ *   create the pipe before sys_fork().  Returns 0, or -1 if out of pipes
+ *   or file descriptors.
+ *
+ *****************************************************************************/
+
+static inline int
+sys_pipe(int fds[2])
+{
+	int result, wfd;
+	asm volatile("int %2\n"
+		     : "=a" (result), "=b" (wfd)
+		     : "i" (INT_SYS_PIPE)
+		     : "cc", "memory");
+	if (result < 0)
+		return -1;
+	fds[0] = result;
+	fds[1] = wfd;
+	return 0;
+}
+
+
+
+/*****************************************************************************
+ * sys_read(fd, buf, n)
+ *
+ *   Read up to 'n' bytes from the pipe at file descriptor 'fd' into 'buf'.
+ *   If the pipe is empty, blocks until someone writes to it.  Returns the
+ *   number of bytes read; 0 means end of file (the pipe is empty and every
+ *   write end is closed).  Returns -1 on error.
+ *
+ * sys_write(fd, buf, n)
+ *
+ *   Write up to 'n' bytes from 'buf' into the pipe at file descriptor
+ *   'fd'.  If the pipe is full, blocks until someone reads from it.
+ *   Returns the number of bytes written, which may be less than 'n': loop
+ *   to write everything.  Returns -1 on error, including if every read end
+ *   is closed.
+ *
+ * sys_close(fd)
+ *
+ *   Close file descriptor 'fd'.  Returns 0, or -1 if 'fd' is not open.
+ *   A process's file descriptors are closed when it exits.
+ *
+ *****************************************************************************/
+
+static inline ssize_t
+sys_read(int fd, void *buf, size_t n)
+{
+	ssize_t result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_READ),
+		       "a" (fd),
+		       "b" (buf),
+		       "c" (n)
+		     : "cc", "memory");
+	return result;
+}
+
+static inline ssize_t
+sys_write(int fd, const void *buf, size_t n)
+{
+	ssize_t result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_WRITE),
+		       "a" (fd),
+		       "b" (buf),
+		       "c" (n)
+		     : "cc", "memory");
+	return result;
+}
+
+static inline int
+sys_close(int fd)
+{
+	int result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_CLOSE),
+		       "a" (fd)
+		     : "cc", "memory");
+	return result;
+}
+
+
+
+/*****************************************************************************
+ * sys_console_flush
+ *
+ *   Copy everything in this process's console buffer (see const.h) onto
+ *   the screen, and empty the buffer.  The kernel writes the whole buffer
+ *   at once, so other processes' output never lands in the middle of it.
+ *
+ *****************************************************************************/
+
+static inline void
+sys_console_flush(void)
+{
+	asm volatile("int %0\n"
+		     : : "i" (INT_SYS_CONSOLE_FLUSH)
+		     : "cc", "memory");
+}
+
+
+
 /*****************************************************************************
  * app_printf(format, ...)
  *
- *   Calls console_printf() (see lib.h).
- *   The cursor position is read from 'cursorpos', a shared variable defined
- *   by the kernel, and written back into that variable.
+ *   Formats like console_printf() (see lib.h), but into this process's
+ *   console buffer, 'consolebuf', rather than straight onto the screen.
+ *   The buffer is flushed with sys_console_flush() when it fills up, and,
+ *   if it's line-buffered, whenever app_printf() prints a newline.  So
+ *   processes printing at the same time no longer interleave mid-line.
  *   The initial color is based on the current process ID.
  *
  *****************************************************************************/
 
+typedef struct app_printer {
+	printer_t p;
+	bool_t newline;			// Printed a newline?
+} app_printer_t;
+
+static void
+app_printer_putc(printer_t *p, unsigned char c, int color)
+{
+	if (consolebuf.cb_len >= CONSOLEBUF_SIZE)
+		sys_console_flush();
+	consolebuf.cb_cells[consolebuf.cb_len++] = c | color;
+	if (c == '\n')
+		((app_printer_t *) p)->newline = 1;
+}
+
 static void app_printf(const char *format, ...) __attribute__((noinline));
 
 static void
 app_printf(const char *format, ...)
 {
+	app_printer_t ap;
+
 	// set default color based on currently running process
 	int color = sys_getpid();
 	if (color < 0)
@@ -187,10 +457,15 @@ app_printf(const char *format, ...)
 		color = col[color % sizeof(col)] << 8;
 	}
 
+	ap.p.putc = app_printer_putc;
+	ap.newline = 0;
 	va_list val;
 	va_start(val, format);
-	cursorpos = console_vprintf(cursorpos, color, format, val);
+	printer_vprintf(&ap.p, color, format, val);
 	va_end(val);
+
+	if (ap.newline && consolebuf.cb_mode == CONSOLEBUF_LINE)
+		sys_console_flush();
 }
 
 #endif
@@ -0,0 +1,99 @@
+#ifndef WEENSYOS_UTHREAD_H
+#define WEENSYOS_UTHREAD_H
+#include "types.h"
+
+/*****************************************************************************
+ * uthread.h
+ *
+ *   A tiny user-level threading library for applications.
+ *
+ *   Threads are cooperative: a thread runs until it calls uthread_yield(),
+ *   uthread_exit(), or blocks on a channel.  Switching between threads in
+ *   the same process is a handful of instructions (see uthread-switch.S)
+ *   and never enters the kernel.  If every thread in the process is
+ *   blocked, no thread can ever wake the others, so the process exits with
+ *   status UTHREAD_DEADLOCK.
+ *
+ *   The thread that first calls into the library (normally the one running
+ *   pmain) becomes thread 0 and keeps using the process's own stack.  Other
+ *   threads get a UTHREAD_STACK_SIZE-byte stack from a static pool.
+ *
+ *   Note: The library keeps its state in global variables.  In MiniprocOS,
+ *   all processes share their globals, so only one process at a time may
+ *   use uthreads.
+ *
+ *****************************************************************************/
+
+#ifndef UTHREAD_MAX
+#define UTHREAD_MAX		8	// Maximum number of threads
+#endif
+#ifndef UTHREAD_STACK_SIZE
+#define UTHREAD_STACK_SIZE	2048	// Stack size for threads 1 and up
+#endif
+
+// Exit status of a process whose threads are all blocked
+#define UTHREAD_DEADLOCK	(-1)
+
+typedef struct uthread uthread_t;
+
+// A channel is a bounded FIFO of 32-bit values.  uthread_chan_send() blocks
+// while the channel is full; uthread_chan_recv() blocks while it is empty.
+typedef struct uthread_chan {
+	uint32_t *ch_buf;		// Storage for 'ch_capacity' values
+	int ch_capacity;
+	int ch_head;			// Index of the oldest value
+	int ch_count;			// Number of values in the channel
+	uthread_t *ch_senders;		// Threads blocked in send
+	uthread_t *ch_receivers;	// Threads blocked in recv
+} uthread_chan_t;
+
+
+/*****************************************************************************
+ * uthread_create(fn, arg)
+ *
+ *   Start a new thread running 'fn(arg)'.  The new thread is runnable, but
+ *   does not run until the caller yields or blocks.  If 'fn' returns, the
+ *   thread exits.  Returns the new thread's ID, or -1 if there are already
+ *   UTHREAD_MAX threads.
+ *
+ * uthread_yield()
+ *
+ *   Run the next runnable thread.  If no other thread is runnable, the
+ *   caller keeps running.
+ *
+ * uthread_exit()
+ *
+ *   Exit the calling thread.  When the last thread exits, the process exits
+ *   with status 0.
+ *
+ * uthread_self()
+ *
+ *   Return the calling thread's ID.
+ *
+ *****************************************************************************/
+
+int uthread_create(void (*fn)(void *), void *arg);
+void uthread_yield(void);
+void uthread_exit(void) __attribute__((noreturn));
+int uthread_self(void);
+
+
+/*****************************************************************************
+ * uthread_chan_init(ch, buf, capacity)
+ *
+ *   Initialize 'ch' as an empty channel holding up to 'capacity' values in
+ *   'buf', which must have room for 'capacity' uint32_t's.
+ *
+ * uthread_chan_send(ch, value)
+ * uthread_chan_recv(ch)
+ *
+ *   Append 'value' to, or remove and return the oldest value from, 'ch',
+ *   blocking the calling thread as needed.
+ *
+ *****************************************************************************/
+
+void uthread_chan_init(uthread_chan_t *ch, uint32_t *buf, int capacity);
+void uthread_chan_send(uthread_chan_t *ch, uint32_t value);
+uint32_t uthread_chan_recv(uthread_chan_t *ch);
+
+#endif /* !WEENSYOS_UTHREAD_H */
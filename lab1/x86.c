@@ -69,6 +69,8 @@ pseudodescriptor_t interrupt_descriptor_table = {
 };
 
 // Particular interrupt handler routines
+extern void fpu_int_handler(void);
+extern void page_fault_int_handler(void);
 extern void (*sys_int_handlers[])(void);
 extern void default_int_handler(void);
 
@@ -94,10 +96,19 @@ segments_init(void)
 		SETGATE(interrupt_descriptors[i], 0,
 			SEGSEL_KERN_CODE, default_int_handler, 0);
 
+	// The page fault handler fixes up copy-on-write and demand-zero
+	// pages (see virtual_memory_fault()).
+	SETGATE(interrupt_descriptors[INT_PAGEFAULT], 0,
+		SEGSEL_KERN_CODE, page_fault_int_handler, 0);
+
+	// So does the first FPU use after a context switch (see fpu_init()).
+	SETGATE(interrupt_descriptors[INT_FPU], 0,
+		SEGSEL_KERN_CODE, fpu_int_handler, 0);
+
 	// System calls get special handling.
 	// Note that the last argument is '3'.  This means that unprivileged
 	// (level-3) applications may generate these interrupts.
-	for (i = INT_SYS_GETPID; i < INT_SYS_GETPID + 10; i++)
+	for (i = INT_SYS_GETPID; i < INT_SYS_GETPID + 14; i++)
 		SETGATE(interrupt_descriptors[i], 0,
 			SEGSEL_KERN_CODE, sys_int_handlers[i - INT_SYS_GETPID], 3);
 
@@ -113,6 +124,55 @@ segments_init(void)
 
 
 
+/*****************************************************************************
+ * cycle_counter_calibrate
+ *
+ *   Measure the rate of the cycle counter (see read_cycle_counter()), in
+ *   cycles per millisecond, by timing 10 ms on channel 2 of the 8253 timer.
+ *   Channel 2 normally drives the PC speaker; the speaker stays off.
+ *
+ *****************************************************************************/
+
+#define	IO_TIMER1	0x040		/* 8253 Timer #1 */
+#define	IO_TIMER2	(IO_TIMER1 + 2)	/* 8253 Timer #2 */
+#define	TIMER_MODE	(IO_TIMER1 + 3)	/* timer mode port */
+#define	  TIMER_SEL2	0x80		/* select counter 2 */
+#define	  TIMER_INTTC	0x00		/* mode 0, intr on terminal cnt */
+#define   TIMER_16BIT	0x30		/* r/w counter 16 bits, LSB first */
+#define	IO_PPI		0x61		/* timer 2 gate and speaker control */
+#define	  PPI_TIMER2_GATE	0x01
+#define	  PPI_SPEAKER		0x02
+#define	  PPI_TIMER2_OUT	0x20
+
+// Timer frequency: (TIMER_FREQ/freq) generates a frequency of 'freq' Hz.
+#define	TIMER_FREQ	1193182
+#define TIMER_DIV(x)	((TIMER_FREQ+(x)/2)/(x))
+
+uint32_t
+cycle_counter_calibrate(void)
+{
+	uint8_t ppi = inb(IO_PPI);
+	uint64_t start, end;
+
+	// Enable counting on timer 2, but keep the speaker disconnected
+	outb(IO_PPI, (ppi & ~PPI_SPEAKER) | PPI_TIMER2_GATE);
+
+	// Count down 10 ms; the timer's output goes high when it hits zero
+	outb(TIMER_MODE, TIMER_SEL2 | TIMER_INTTC | TIMER_16BIT);
+	outb(IO_TIMER2, TIMER_DIV(100) % 256);
+	outb(IO_TIMER2, TIMER_DIV(100) / 256);
+
+	start = read_cycle_counter();
+	while (!(inb(IO_PPI) & PPI_TIMER2_OUT))
+		/* do nothing */;
+	end = read_cycle_counter();
+
+	outb(IO_PPI, ppi);
+	return (uint32_t) (end - start) / 10;
+}
+
+
+
 /*****************************************************************************
  * special_registers_init
  *
@@ -134,6 +194,284 @@ special_registers_init(process_t *proc)
 
 
 
+/*****************************************************************************
+ * virtual_memory_init
+ *
+ *   Set up the kernel's page directory and turn on paging.
+ *
+ *   The kernel's page directory identity-maps the first 4 MB of physical
+ *   memory, except page 0 (to catch null pointers).  Everything below
+ *   FRAME_POOL_START -- the kernel, the console, and the application's code
+ *   and globals -- stays accessible to applications, as in MiniprocOS
+ *   without paging.  The exception is the kerneldata page, which processes
+ *   may read but not write.  The page pool (k-palloc.c) is for the kernel
+ *   only.
+ *
+ *   Each process gets its own page directory, which shares those mappings
+ *   and adds the process's own stack, just below PROC_STACK_TOP.  So every
+ *   process sees its stack at the same addresses.
+ *
+ *****************************************************************************/
+
+// The kernel's page directory
+pagedirectory_t kernel_pagedir;
+
+static pte_t *
+pagetable_alloc(void)
+{
+	pte_t *pt = (pte_t *) page_alloc();
+	if (pt)
+		memset(pt, 0, PAGESIZE);
+	return pt;
+}
+
+// Return a pointer to the page table entry for 'va' in 'pagedir'.
+// If 'create' is true, allocate the page table if necessary.  The page
+// tables holding kernel mappings are shared by every page directory, so in
+// that case a page table still shared with 'kernel_pagedir' is replaced
+// with a private copy first.
+// Returns NULL if there is no page table (or no memory to make one).
+static pte_t *
+pagetable_walk(pagedirectory_t pagedir, uintptr_t va, bool_t create)
+{
+	pte_t *pde = &pagedir[PDX(va)];
+	pte_t *pt;
+
+	if (create && (!(*pde & PTE_P) || (pagedir != kernel_pagedir
+					   && *pde == kernel_pagedir[PDX(va)]))) {
+		if (!(pt = pagetable_alloc()))
+			return NULL;
+		if (*pde & PTE_P)
+			memcpy(pt, (pte_t *) PTE_ADDR(*pde), PAGESIZE);
+		*pde = (physaddr_t) pt | PTE_P | PTE_W | PTE_U;
+	} else if (!(*pde & PTE_P))
+		return NULL;
+
+	return &((pte_t *) PTE_ADDR(*pde))[PTX(va)];
+}
+
+void
+virtual_memory_init(void)
+{
+	uintptr_t va, kd = ROUNDDOWN((uintptr_t) &kerneldata, PAGESIZE);
+	pte_t perm;
+
+	kernel_pagedir = pagetable_alloc();
+	for (va = PAGESIZE; va < FRAME_POOL_END; va += PAGESIZE) {
+		if (va == kd)
+			perm = PTE_U;
+		else if (va < FRAME_POOL_START)
+			perm = PTE_U | PTE_W;
+		else
+			perm = PTE_W;
+		*pagetable_walk(kernel_pagedir, va, 1) = va | PTE_P | perm;
+	}
+
+	// Leave CR0_WP off, so the kernel can write to pages that are
+	// read-only for processes.
+	lcr3(kernel_pagedir);
+	lcr0(rcr0() | CR0_PG);
+}
+
+
+
+/*****************************************************************************
+ * pagedir_create
+ *
+ *   Return a new page directory containing just the kernel's mappings,
+ *   or NULL if out of memory.
+ *
+ * pagedir_fork(pagedir)
+ *
+ *   Return a copy of process page directory 'pagedir', or NULL if out of
+ *   memory.  The copy shares every process page with the original.  Pages
+ *   that were writable become read-only and copy-on-write in both, so
+ *   whichever process writes to such a page first gets its own copy (see
+ *   virtual_memory_fault()).  Nothing is copied but page tables, so the
+ *   cost does not depend on how much of the stack is in use.
+ *
+ * pagedir_free(pagedir)
+ *
+ *   Free a page directory made by pagedir_create() or pagedir_fork(),
+ *   along with its private page tables, dropping a reference to every
+ *   process page it maps.  'pagedir' must not be the current page
+ *   directory.
+ *
+ *****************************************************************************/
+
+pagedirectory_t
+pagedir_create(void)
+{
+	pagedirectory_t pagedir = pagetable_alloc();
+	if (pagedir)
+		memcpy(pagedir, kernel_pagedir, PAGESIZE);
+	return pagedir;
+}
+
+pagedirectory_t
+pagedir_fork(pagedirectory_t pagedir)
+{
+	pagedirectory_t child = pagedir_create();
+	int i, j;
+
+	for (i = 0; child && i < NPTENTRIES; i++) {
+		pte_t *pt = (pte_t *) PTE_ADDR(pagedir[i]), *child_pt;
+		if (!(pagedir[i] & PTE_P) || pagedir[i] == kernel_pagedir[i])
+			continue;
+		if (!(child_pt = pagetable_alloc())) {
+			pagedir_free(child);
+			return NULL;
+		}
+		for (j = 0; j < NPTENTRIES; j++) {
+			if ((pt[j] & (PTE_P | PTE_U)) == (PTE_P | PTE_U)) {
+				if (pt[j] & PTE_W)
+					pt[j] = (pt[j] & ~PTE_W) | PTE_COW;
+				page_incref(PTE_ADDR(pt[j]));
+			}
+			child_pt[j] = pt[j];
+		}
+		child[i] = (physaddr_t) child_pt | PTE_P | PTE_W | PTE_U;
+	}
+
+	// The original lost write access to its pages; flush its TLB.
+	if (child && pagedir == rcr3())
+		lcr3(pagedir);
+	return child;
+}
+
+void
+pagedir_free(pagedirectory_t pagedir)
+{
+	int i, j;
+
+	for (i = 0; i < NPTENTRIES; i++) {
+		pte_t *pt = (pte_t *) PTE_ADDR(pagedir[i]);
+		if (!(pagedir[i] & PTE_P) || pagedir[i] == kernel_pagedir[i])
+			continue;
+		for (j = 0; j < NPTENTRIES; j++)
+			if ((pt[j] & (PTE_P | PTE_U)) == (PTE_P | PTE_U))
+				page_decref(PTE_ADDR(pt[j]));
+		page_decref((physaddr_t) pt);
+	}
+	page_decref((physaddr_t) pagedir);
+}
+
+
+
+/*****************************************************************************
+ * virtual_memory_map(pagedir, va, pa, size, perm)
+ *
+ *   Map virtual addresses [va, va + size) to physical addresses
+ *   [pa, pa + size) in 'pagedir', with permissions 'perm' (a combination of
+ *   PTE_W, PTE_U, and PTE_COW).  Addresses are rounded out to page
+ *   boundaries.  If 'perm' includes PTE_ZERO, 'pa' is ignored: the pages
+ *   are left not present, to be filled with zeroes on first access.  If
+ *   'perm' is PTE_GUARD, 'pa' is ignored too: the pages are guard pages,
+ *   never accessible but reserved.  Returns 0 on success, or -1 if out of
+ *   memory.
+ *
+ * virtual_memory_unmap(pagedir, va, size)
+ *
+ *   Remove every mapping for virtual addresses [va, va + size) from
+ *   'pagedir', dropping its references to the pages that were mapped.
+ *
+ * virtual_memory_lookup(pagedir, va)
+ *
+ *   Return a pointer to the page table entry for 'va' in 'pagedir', or
+ *   NULL if there is no page table for 'va'.
+ *
+ * virtual_memory_fault(pagedir, va, write)
+ *
+ *   Handle a process's page fault on 'va' in 'pagedir', where 'write' says
+ *   whether the access was a write.  A demand-zero page gets a fresh zeroed
+ *   page; a write to a copy-on-write page gets a private copy of the page
+ *   (or, if no other process still shares the page, just write
+ *   permission).  Returns 0 if the access can now succeed, or -1 if it is
+ *   not allowed (or there is no memory to allow it).
+ *
+ *****************************************************************************/
+
+int
+virtual_memory_map(pagedirectory_t pagedir, uintptr_t va, physaddr_t pa,
+		   size_t size, int perm)
+{
+	uintptr_t end = ROUNDUP(va + size, PAGESIZE);
+	pte_t *pte;
+
+	pa = ROUNDDOWN(pa, PAGESIZE);
+	for (va = ROUNDDOWN(va, PAGESIZE); va < end; va += PAGESIZE) {
+		if (!(pte = pagetable_walk(pagedir, va, 1)))
+			return -1;
+		if (perm & (PTE_ZERO | PTE_GUARD))
+			*pte = perm;
+		else
+			*pte = pa | perm | PTE_P;
+		if (pagedir == rcr3())
+			invlpg((void *) va);
+		pa += PAGESIZE;
+	}
+	return 0;
+}
+
+void
+virtual_memory_unmap(pagedirectory_t pagedir, uintptr_t va, size_t size)
+{
+	uintptr_t end = ROUNDUP(va + size, PAGESIZE);
+	pte_t *pte;
+
+	for (va = ROUNDDOWN(va, PAGESIZE); va < end; va += PAGESIZE) {
+		if (!(pte = pagetable_walk(pagedir, va, 0)) || !*pte)
+			continue;
+		if ((*pte & (PTE_P | PTE_U)) == (PTE_P | PTE_U))
+			page_decref(PTE_ADDR(*pte));
+		*pte = 0;
+		if (pagedir == rcr3())
+			invlpg((void *) va);
+	}
+}
+
+pte_t *
+virtual_memory_lookup(pagedirectory_t pagedir, uintptr_t va)
+{
+	return pagetable_walk(pagedir, va, 0);
+}
+
+int
+virtual_memory_fault(pagedirectory_t pagedir, uintptr_t va, bool_t write)
+{
+	pte_t *pte = pagetable_walk(pagedir, va, 0);
+	physaddr_t pa;
+
+	if (!pte || !(*pte & PTE_U))
+		return -1;
+
+	if (*pte & PTE_ZERO) {
+		if (!(pa = page_alloc()))
+			return -1;
+		memset((void *) pa, 0, PAGESIZE);
+		*pte = pa | (*pte & (PTE_U | PTE_W | PTE_COW)) | PTE_P;
+	}
+
+	if (write && (*pte & PTE_COW)) {
+		pa = PTE_ADDR(*pte);
+		if (page_refcount(pa) != 1) {
+			physaddr_t copy = page_alloc();
+			if (!copy)
+				return -1;
+			memcpy((void *) copy, (void *) pa, PAGESIZE);
+			page_decref(pa);
+			pa = copy;
+		}
+		*pte = pa | PTE_P | PTE_U | PTE_W;
+		if (pagedir == rcr3())
+			invlpg((void *) va);
+	}
+
+	return (*pte & PTE_P) && (!write || (*pte & PTE_W)) ? 0 : -1;
+}
+
+
+
 /*****************************************************************************
  * console_clear
  *
@@ -195,13 +533,126 @@ console_read_digit(void)
 }
 
 
+/*****************************************************************************
+ * fpu_init
+ *
+ *   Set up the floating-point unit for lazy context switching.
+ *
+ *   The kernel never uses the floating-point and SSE registers, and many
+ *   processes don't either, so context switches do not save and restore
+ *   them.  Instead the FPU holds the state of one process, 'fpu_owner'.
+ *   run() sets CR0_TS whenever it runs any other process, so that the
+ *   process's first floating-point or SSE instruction traps (INT_FPU).
+ *   fpu_trap() then saves the owner's state in its process descriptor,
+ *   loads the current process's state, and makes it the owner.  Switches
+ *   between processes that never use the FPU cost nothing extra.
+ *
+ * fpu_trap
+ *
+ *   Handle an INT_FPU exception by handing the FPU to 'current'.  A
+ *   process's first FPU use starts from a freshly initialized state.
+ *
+ * fpu_release(proc)
+ *
+ *   Forget the FPU state of 'proc', which is exiting.
+ *
+ * fpu_fork(child, parent)
+ *
+ *   Give 'child' a copy of 'parent's FPU state, for sys_fork().
+ *
+ *****************************************************************************/
+
+static process_t *fpu_owner;		// Process whose state is in the FPU
+static bool_t fpu_trapping;		// Is CR0_TS set?
+static bool_t fpu_fxsr;			// Use 'fxsave'/'fxrstor'?
+static fpustate_t fpu_initial_state;	// State for a process's first use
+
+static void
+fpu_save(fpustate_t *fpu)
+{
+	if (fpu_fxsr)
+		fxsave(fpu);
+	else
+		fnsave(fpu);
+}
+
+static void
+fpu_restore(const fpustate_t *fpu)
+{
+	if (fpu_fxsr)
+		fxrstor(fpu);
+	else
+		frstor(fpu);
+}
+
+void
+fpu_init(void)
+{
+	uint32_t edx;
+
+	// 'fxsave' saves the SSE registers too, but the processor supports
+	// SSE only once the kernel says it will save them (CR4_OSFXSR).
+	cpuid(1, NULL, NULL, NULL, &edx);
+	fpu_fxsr = (edx & CPUID_EDX_FXSR) != 0;
+	if (fpu_fxsr)
+		lcr4(rcr4() | CR4_OSFXSR);
+
+	// Run floating-point instructions on the FPU, not by trapping
+	// (CR0_EM); make CR0_TS apply to 'fwait' too (CR0_MP); report
+	// floating-point errors as exceptions (CR0_NE).
+	lcr0((rcr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+	fninit();
+	fpu_save(&fpu_initial_state);
+
+	lcr0(rcr0() | CR0_TS);
+	fpu_trapping = 1;
+}
+
+void
+fpu_trap(void)
+{
+	clts();
+	fpu_trapping = 0;
+	if (fpu_owner == current)
+		return;
+	if (fpu_owner)
+		fpu_save(&fpu_owner->p_fpu);
+	fpu_restore(current->p_fpu_used ? &current->p_fpu : &fpu_initial_state);
+	current->p_fpu_used = 1;
+	fpu_owner = current;
+}
+
+void
+fpu_release(process_t *proc)
+{
+	if (fpu_owner == proc)
+		fpu_owner = NULL;
+	proc->p_fpu_used = 0;
+}
+
+void
+fpu_fork(process_t *child, process_t *parent)
+{
+	// Get the parent's live state out of the FPU first.  The parent
+	// gives up ownership, since 'fnsave' resets the FPU.
+	if (fpu_owner == parent) {
+		fpu_save(&parent->p_fpu);
+		fpu_owner = NULL;
+	}
+	child->p_fpu_used = parent->p_fpu_used;
+	if (parent->p_fpu_used)
+		child->p_fpu = parent->p_fpu;
+}
+
+
+
 /*****************************************************************************
  * run
  *
  *   Run the process with the supplied process descriptor.
- *   This means reloading all the relevant registers from the descriptor's
- *   p_registers member, using the 'popal', 'popl', and 'iret'
- *   instructions.
+ *   This means switching to its page directory, then reloading all the
+ *   relevant registers from the descriptor's p_registers member, using the
+ *   'popal', 'popl', and 'iret' instructions.
  *
  *****************************************************************************/
 
@@ -209,6 +660,15 @@ void
 run(process_t *proc)
 {
 	current = proc;
+	kerneldata_update(proc);
+	if (rcr3() != proc->p_pagedir)
+		lcr3(proc->p_pagedir);
+
+	// Only the FPU's owner may use it without trapping.
+	if ((proc != fpu_owner) != fpu_trapping) {
+		lcr0(rcr0() ^ CR0_TS);
+		fpu_trapping = !fpu_trapping;
+	}
 
 	asm volatile("movl %0,%%esp\n\t"
 		     "popal\n\t"
@@ -0,0 +1,444 @@
+#include "kernel.h"
+#include "x86.h"
+#include "lib.h"
+
+/*****************************************************************************
+ * k-bench.c
+ *
+ *   Kernel micro-benchmarks.
+ *
+ *   A kernel built with
+ *
+ *	make DEFS=-DSCHEDOS_BENCHMARK
+ *
+ *   runs benchmarks_run() at boot instead of starting the processes, prints
+ *   the results on the console, and stops.  Costs are in cycle-counter
+ *   ticks (see read_cycle_counter()).
+ *
+ *****************************************************************************/
+
+#define BENCH_ITERATIONS	1000
+
+static void
+bench_printf(const char *format, ...)
+{
+	va_list val;
+	va_start(val, format);
+	cursorpos = console_vprintf(cursorpos, 0x0700, format, val);
+	va_end(val);
+}
+
+
+/*****************************************************************************
+ * Address space switches
+ *
+ *   Each iteration loads a process page directory into %cr3, then touches
+ *   BENCH_TOUCH_PAGES kernel pages, the way the kernel's interrupt and
+ *   scheduling paths do after a context switch.  With global pages
+ *   (CR4_PGE), the kernel's translations survive the %cr3 load; without
+ *   them, every touched page costs a TLB miss.  The baseline skips the %cr3
+ *   load entirely, as run() does when the page directory does not change.
+ *
+ *****************************************************************************/
+
+#define BENCH_TOUCH_PAGES	24
+
+static void
+touch_kernel_pages(void)
+{
+	volatile uint32_t *p = (volatile uint32_t *) 0x100000;
+	int i;
+	for (i = 0; i < BENCH_TOUCH_PAGES; i++)
+		(void) p[i * (PAGESIZE / sizeof(uint32_t))];
+}
+
+static uint32_t
+time_switches(pagedirectory_t a, pagedirectory_t b, bool_t reload)
+{
+	uint64_t start;
+	int i;
+
+	start = read_cycle_counter();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		if (reload)
+			lcr3(a);
+		touch_kernel_pages();
+		if (reload)
+			lcr3(b);
+		touch_kernel_pages();
+	}
+	return (uint32_t) (read_cycle_counter() - start)
+		/ (2 * BENCH_ITERATIONS);
+}
+
+static void
+benchmark_address_space_switch(void)
+{
+	pagedirectory_t a = pagedir_create(), b = pagedir_create();
+	pagedirectory_t saved_pagedir = rcr3();
+	uint32_t cr4 = rcr4(), ecx, edx;
+
+	bench_printf("Address space switch + %d kernel page touches:\n",
+		     BENCH_TOUCH_PAGES);
+	if (!a || !b) {
+		bench_printf("  out of memory\n");
+		return;
+	}
+	cpuid(1, NULL, NULL, &ecx, &edx);
+
+	bench_printf("  no %%cr3 load:           %u cycles\n",
+		     time_switches(a, a, 0));
+
+	lcr4(cr4 & ~CR4_PGE);
+	bench_printf("  %%cr3 load, no global:   %u cycles\n",
+		     time_switches(a, b, 1));
+
+	if (edx & CPUID_EDX_PGE) {
+		lcr4(cr4 | CR4_PGE);
+		bench_printf("  %%cr3 load, global:      %u cycles\n",
+			     time_switches(a, b, 1));
+	} else
+		bench_printf("  (no global page support)\n");
+
+	bench_printf("  (PCID %s, but needs 64-bit mode)\n",
+		     (ecx & CPUID_ECX_PCID) ? "present" : "absent");
+
+	lcr4(cr4);
+	lcr3(saved_pagedir);
+}
+
+
+/*****************************************************************************
+ * TLB reach
+ *
+ *   Maps BENCH_LARGE_BLOCKS physically contiguous 4 MB blocks twice, once
+ *   with 4 KB pages and once with 4 MB pages, then reads one word from
+ *   every 4 KB page of the region, over and over.  With 4 KB pages the
+ *   region needs far more translations than the TLB holds; with 4 MB pages
+ *   it needs BENCH_LARGE_BLOCKS.  Also reports how many page tables the
+ *   kernel's own identity map saves by using 4 MB pages.
+ *
+ *****************************************************************************/
+
+#define BENCH_LARGE_BLOCKS	4
+
+static uint32_t
+time_touches(pagedirectory_t pagedir)
+{
+	volatile uint32_t *p = (volatile uint32_t *) PROC_VA_START;
+	size_t npages = BENCH_LARGE_BLOCKS * NPTENTRIES, i;
+	uint64_t start = 0;
+	int pass;
+
+	lcr3(pagedir);
+	// The first pass warms up the caches.
+	for (pass = -1; pass < 10; pass++) {
+		if (pass == 0)
+			start = read_cycle_counter();
+		for (i = 0; i < npages; i++)
+			(void) p[i * (PAGESIZE / sizeof(uint32_t))];
+	}
+	return (uint32_t) (read_cycle_counter() - start) / (10 * npages);
+}
+
+static void
+benchmark_large_pages(void)
+{
+	physaddr_t blocks[BENCH_LARGE_BLOCKS];
+	pagedirectory_t small = pagedir_create(), large = pagedir_create();
+	pagedirectory_t saved_pagedir = rcr3();
+	bool_t ok = (small && large), have_large = 1;
+	int i, npts = 0, nlarge = 0;
+
+	for (i = 0; i < NPTENTRIES; i++)
+		if (kernel_pagedir[i] & PTE_PS)
+			nlarge++;
+		else if (kernel_pagedir[i] & PTE_P)
+			npts++;
+	bench_printf("\nKernel identity map: %d page tables + %d 4 MB pages "
+		     "(%d page tables without)\n", npts, nlarge, npts + nlarge);
+
+	bench_printf("Read 1 word/page from %d MB:\n", BENCH_LARGE_BLOCKS * 4);
+	for (i = 0; i < BENCH_LARGE_BLOCKS; i++) {
+		uintptr_t va = PROC_VA_START + i * PTSIZE;
+		blocks[i] = page_alloc(PAGE_MAX_ORDER);
+		if (!blocks[i] || !ok
+		    || virtual_memory_map(small, va, blocks[i], PTSIZE, PTE_W) < 0)
+			ok = 0;
+		else if (virtual_memory_map(large, va, blocks[i], PTSIZE,
+					    PTE_W | PTE_PS) < 0)
+			have_large = 0;
+	}
+
+	if (!ok)
+		bench_printf("  out of memory\n");
+	else {
+		bench_printf("  4 KB pages:             %u cycles\n",
+			     time_touches(small));
+		if (have_large)
+			bench_printf("  4 MB pages:             %u cycles\n",
+				     time_touches(large));
+		else
+			bench_printf("  (no 4 MB page support)\n");
+	}
+
+	lcr3(saved_pagedir);
+	for (i = 0; i < BENCH_LARGE_BLOCKS; i++)
+		if (blocks[i])
+			page_free(blocks[i], PAGE_MAX_ORDER);
+	if (small)
+		pagedir_free(small);
+	if (large)
+		pagedir_free(large);
+}
+
+
+/*****************************************************************************
+ * Kernel object allocation
+ *
+ *   Allocates BENCH_SLAB_OBJECTS small objects, then frees them all, both
+ *   from a slab cache and as whole pages from the page allocator.
+ *
+ *****************************************************************************/
+
+#define BENCH_SLAB_OBJECTS	256
+#define BENCH_SLAB_SIZE		48
+
+static void
+benchmark_slab(void)
+{
+	static slab_cache_t cache;
+	static void *objs[BENCH_SLAB_OBJECTS];
+	slabstats_t ss;
+	uint64_t start;
+	uint32_t slab_cycles, page_cycles;
+	int i, index;
+
+	slab_cache_init(&cache, "bench", BENCH_SLAB_SIZE);
+	for (index = 0; slab_cache_stats(index, &ss) == 0; index++)
+		/* find the index of 'cache' */;
+	index--;
+
+	bench_printf("\nAllocate + free %d %d-byte objects:\n",
+		     BENCH_SLAB_OBJECTS, BENCH_SLAB_SIZE);
+
+	start = read_cycle_counter();
+	for (i = 0; i < BENCH_SLAB_OBJECTS; i++)
+		objs[i] = slab_alloc(&cache);
+	for (i = 0; i < BENCH_SLAB_OBJECTS; i++)
+		if (objs[i])
+			slab_free(&cache, objs[i]);
+	slab_cycles = (uint32_t) (read_cycle_counter() - start)
+		/ BENCH_SLAB_OBJECTS;
+
+	start = read_cycle_counter();
+	for (i = 0; i < BENCH_SLAB_OBJECTS; i++)
+		objs[i] = (void *) page_alloc(0);
+	for (i = 0; i < BENCH_SLAB_OBJECTS; i++)
+		if (objs[i])
+			page_free((physaddr_t) objs[i], 0);
+	page_cycles = (uint32_t) (read_cycle_counter() - start)
+		/ BENCH_SLAB_OBJECTS;
+
+	bench_printf("  slab cache:             %u cycles\n", slab_cycles);
+	bench_printf("  page allocator:         %u cycles\n", page_cycles);
+
+	slab_cache_stats(index, &ss);
+	bench_printf("  (%u objects/slab, %u slabs kept, "
+		     "%u cycles/alloc sampled)\n",
+		     ss.ss_objs_per_slab, ss.ss_nslabs, ss.ss_alloc_cycles);
+}
+
+
+/*****************************************************************************
+ * Program loading
+ *
+ *   Loads program 1 into a fresh page directory, in each loader mode, and
+ *   frees it again.  LOADER_MAP only sets up page tables; LOADER_COPY
+ *   copies the program and clears its bss.  For comparison, the last test
+ *   starts from an already loaded image and copies it copy-on-write, the
+ *   way sys_snapshot_launch() starts a process from a snapshot.
+ *
+ *****************************************************************************/
+
+static uint32_t
+time_load(int mode)
+{
+	int saved_mode = loader_mode;
+	uint32_t entry, total = 0;
+	int i;
+
+	loader_mode = mode;
+	for (i = 0; i < BENCH_ITERATIONS / 10; i++) {
+		uint64_t start = read_cycle_counter();
+		pagedirectory_t pagedir = pagedir_create();
+		int r = (pagedir ? program_loader(0, pagedir, &entry) : -1);
+		total += (uint32_t) (read_cycle_counter() - start);
+		if (pagedir)
+			pagedir_free(pagedir);
+		if (r < 0) {
+			total = 0;
+			break;
+		}
+	}
+	loader_mode = saved_mode;
+	return total / (BENCH_ITERATIONS / 10);
+}
+
+static uint32_t
+time_clone(void)
+{
+	pagedirectory_t template = pagedir_create();
+	uint32_t entry, total = 0;
+	int i;
+
+	if (!template || program_loader(0, template, &entry) < 0) {
+		if (template)
+			pagedir_free(template);
+		return 0;
+	}
+	for (i = 0; i < BENCH_ITERATIONS / 10; i++) {
+		uint64_t start = read_cycle_counter();
+		pagedirectory_t pagedir = pagedir_fork(template);
+		total += (uint32_t) (read_cycle_counter() - start);
+		if (!pagedir) {
+			total = 0;
+			break;
+		}
+		pagedir_free(pagedir);
+	}
+	pagedir_free(template);
+	return total / (BENCH_ITERATIONS / 10);
+}
+
+static void
+benchmark_loader(void)
+{
+	bench_printf("\nLoad program 1:\n");
+	bench_printf("  map (zero-copy):        %u cycles\n",
+		     time_load(LOADER_MAP));
+	bench_printf("  copy:                   %u cycles\n",
+		     time_load(LOADER_COPY));
+	bench_printf("  clone from snapshot:    %u cycles\n", time_clone());
+}
+
+
+/*****************************************************************************
+ * Memory operations
+ *
+ *   Times memcpy(), memset(), and strlen() on buffers from 1 byte to 1 MB,
+ *   against the byte-at-a-time loops lib.c used to have.  The loops go
+ *   through volatile pointers so the compiler can't turn them back into
+ *   calls to the functions they're measured against.
+ *
+ *****************************************************************************/
+
+#define BENCH_MEM_ORDER		8	// 2^8 pages = 1 MB buffers
+
+static void
+byte_memcpy(void *dst, const void *src, size_t n)
+{
+	volatile char *d = (volatile char *) dst;
+	const volatile char *s = (const volatile char *) src;
+	while (n-- > 0)
+		*d++ = *s++;
+}
+
+static void
+byte_memset(void *v, int c, size_t n)
+{
+	volatile char *p = (volatile char *) v;
+	while (n-- > 0)
+		*p++ = c;
+}
+
+static size_t
+byte_strlen(const char *s)
+{
+	const volatile char *p = (const volatile char *) s;
+	while (*p != '\0')
+		++p;
+	return p - s;
+}
+
+// Cycles per call of operation 'op' (0 memcpy, 1 memset, 2 strlen) on
+// 'size' bytes, the fast way if 'fast' is set.
+static uint32_t
+time_memop(int op, bool_t fast, char *dst, char *src, size_t size)
+{
+	uint32_t iters = MIN(1000, MAX(4, (256 * 1024) / size)), i;
+	uint64_t start;
+
+	src[size - 1] = '\0';
+	start = read_cycle_counter();
+	for (i = 0; i < iters; i++)
+		if (op == 0 && fast)
+			memcpy(dst, src, size);
+		else if (op == 0)
+			byte_memcpy(dst, src, size);
+		else if (op == 1 && fast)
+			memset(dst, i, size);
+		else if (op == 1)
+			byte_memset(dst, i, size);
+		else if (fast)
+			(void) strlen(src);
+		else
+			(void) byte_strlen(src);
+	src[size - 1] = 'x';
+	return (uint32_t) (read_cycle_counter() - start) / iters;
+}
+
+static void
+benchmark_memops(void)
+{
+	physaddr_t src = page_alloc(BENCH_MEM_ORDER);
+	physaddr_t dst = page_alloc(BENCH_MEM_ORDER);
+	size_t size;
+
+	bench_printf("\nMemory operations, cycles per call (byte loop / lib.c):"
+		     "\n");
+	if (src && dst) {
+		memset((void *) src, 'x', PAGESIZE << BENCH_MEM_ORDER);
+		bench_printf("     size       memcpy            memset"
+			     "            strlen\n");
+		for (size = 1; size <= (PAGESIZE << BENCH_MEM_ORDER);
+		     size *= 16)
+			bench_printf("  %7u %8u/%-8u %8u/%-8u %8u/%-8u\n", size,
+				     time_memop(0, 0, (char *) dst,
+						(char *) src, size),
+				     time_memop(0, 1, (char *) dst,
+						(char *) src, size),
+				     time_memop(1, 0, (char *) dst,
+						(char *) src, size),
+				     time_memop(1, 1, (char *) dst,
+						(char *) src, size),
+				     time_memop(2, 0, (char *) dst,
+						(char *) src, size),
+				     time_memop(2, 1, (char *) dst,
+						(char *) src, size));
+	} else
+		bench_printf("  out of memory\n");
+
+	if (src)
+		page_free(src, BENCH_MEM_ORDER);
+	if (dst)
+		page_free(dst, BENCH_MEM_ORDER);
+}
+
+
+/*****************************************************************************
+ * benchmarks_run
+ *
+ *****************************************************************************/
+
+void
+benchmarks_run(void)
+{
+	bench_printf("SchedOS kernel benchmarks (cycle counter %u kHz)\n\n",
+		     kerneldata.kd_tsc_khz);
+	benchmark_address_space_switch();
+	benchmark_large_pages();
+	benchmark_slab();
+	benchmark_loader();
+	benchmark_memops();
+}
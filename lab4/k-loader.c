@@ -6,14 +6,15 @@
 /*****************************************************************************
  * k-loader.c
  *
- *   Load a schedos application in from a RAM image.
+ *   Load a schedos application in from a RAM image.  The GNUmakefile
+ *   embeds the images in the kernel page-aligned, so that their pages can
+ *   be mapped into processes directly.
  *
  *   Don't worry about understanding this loader!
  *
  *****************************************************************************/
 
 #define SECTORSIZE		512
-#define PAGESIZE		4096
 
 extern uint8_t _binary_obj_p_schedos_app_1_start[];
 extern uint8_t _binary_obj_p_schedos_app_1_end[];
@@ -34,12 +35,25 @@ struct ramimage {
 	{ _binary_obj_p_schedos_app_4_start, _binary_obj_p_schedos_app_4_end },
 };
 
-static void copyseg(void *dst, const uint8_t *src,
-		    uint32_t filesz, uint32_t memsz);
+static int loadseg(pagedirectory_t pagedir, const struct Proghdr *ph,
+		   const uint8_t *image, const uint8_t *image_end);
+
+// How program_loader() sets up program memory: LOADER_MAP or LOADER_COPY
+int loader_mode = LOADER_MAP;
 static void loader_panic(void);
 
-void
-program_loader(int program_id, uint32_t *entry_point)
+// Return the number of programs program_loader() can load.
+int
+program_count(void)
+{
+	return sizeof(ramimages) / sizeof(ramimages[0]);
+}
+
+// Load program 'program_id' into the address space 'pagedir' and store its
+// entry point in '*entry_point'.  Returns 0 on success, -1 if the program
+// does not fit in process memory or there is not enough physical memory.
+int
+program_loader(int program_id, pagedirectory_t pagedir, uint32_t *entry_point)
 {
 	struct Proghdr *ph, *eph;
 	struct Elf *elf_header;
@@ -53,35 +67,89 @@ program_loader(int program_id, uint32_t *entry_point)
 	if (elf_header->e_magic != ELF_MAGIC)
 		loader_panic();
 
-	// load each program segment (ignores ph flags)
+	// load each program segment
 	ph = (struct Proghdr*) ((const uint8_t *) elf_header + elf_header->e_phoff);
 	eph = ph + elf_header->e_phnum;
 	for (; ph < eph; ph++)
-		if (ph->p_type == ELF_PROG_LOAD)
-			copyseg((void *) ph->p_va,
-				(const uint8_t *) elf_header + ph->p_offset,
-				ph->p_filesz, ph->p_memsz);
+		if (ph->p_type == ELF_PROG_LOAD
+		    && loadseg(pagedir, ph, (const uint8_t *) elf_header,
+			       ramimages[program_id].end) < 0)
+			return -1;
 
 	// store the entry point from the ELF header
 	*entry_point = elf_header->e_entry;
+	return 0;
 }
 
-// Copy 'filesz' bytes starting at address 'data' into virtual address 'dst',
-// then clear the memory from 'va+filesz' up to 'va+memsz' (set it to 0).
-static void
-copyseg(void *dst, const uint8_t *src, uint32_t filesz, uint32_t memsz)
+// Set up the pages that segment 'ph' spans in 'pagedir'.
+//
+// In LOADER_MAP mode, no program data is copied.  A page whose contents
+// come entirely from the file is mapped straight from the RAM image:
+// read-only if the segment is read-only, copy-on-write if it is writable.
+// A page past the end of the file data (bss) is demand-zero.  Only a page
+// that mixes file data with bss, or that a page-aligned image page cannot
+// supply, gets a private page and a copy of its file data, as does every
+// page in LOADER_COPY mode.  A page shared with an earlier segment becomes
+// private too, with the union of both segments' permissions.
+static int
+loadseg(pagedirectory_t pagedir, const struct Proghdr *ph,
+	const uint8_t *image, const uint8_t *image_end)
 {
-	uint32_t va = (uint32_t) dst;
-	uint32_t end_va = va + filesz;
-	memsz += va;
-	va &= ~(PAGESIZE - 1);		// round to page boundary
+	uintptr_t va, end = ph->p_va + ph->p_memsz;
+	uintptr_t file_end = ph->p_va + ph->p_filesz;
+	int perm = PTE_U | (ph->p_flags & ELF_PROG_FLAG_WRITE ? PTE_W : 0);
+
+	if (ph->p_va < PROC_VA_START || end < ph->p_va
+	    || end > PROC_VA_END - PROC_STACK_SIZE || ph->p_filesz > ph->p_memsz
+	    || ph->p_offset + ph->p_filesz > (uint32_t) (image_end - image))
+		return -1;
+
+	for (va = ROUNDDOWN(ph->p_va, PAGESIZE); va < end; va += PAGESIZE) {
+		pte_t *pte = virtual_memory_lookup(pagedir, va);
+		const uint8_t *src = image + ph->p_offset + (va - ph->p_va);
+		uintptr_t lo = MAX(va, ph->p_va);
+		uintptr_t hi = MIN(va + PAGESIZE, file_end);
+		physaddr_t pa;
 
-	// copy data
-	memcpy((uint8_t *) va, src, end_va - va);
+		if (pte && (*pte & (PTE_P | PTE_ZERO))) {
+			// Shared with an earlier segment: make it private.
+			int old_w = (*pte & (PTE_W | PTE_COW) ? PTE_W : 0);
+			*pte |= PTE_COW;
+			if (virtual_memory_fault(pagedir, va, 1) < 0)
+				return -1;
+			*pte = (*pte & ~PTE_W) | perm | old_w;
+		} else if (loader_mode == LOADER_MAP && va >= file_end) {
+			if (virtual_memory_map(pagedir, va, 0, PAGESIZE,
+					       perm | PTE_ZERO) < 0)
+				return -1;
+			continue;
+		} else if (loader_mode == LOADER_MAP
+			   && file_end >= MIN(va + PAGESIZE, end)
+			   && (uintptr_t) src % PAGESIZE == 0
+			   && src >= image && src + PAGESIZE <= image_end) {
+			if (virtual_memory_map(pagedir, va, (physaddr_t) src,
+					       PAGESIZE, perm & PTE_W
+					       ? PTE_U | PTE_COW : PTE_U) < 0)
+				return -1;
+			continue;
+		} else if (!(pa = page_alloc(0)))
+			return -1;
+		else {
+			memset((void *) pa, 0, PAGESIZE);
+			if (virtual_memory_map(pagedir, va, pa, PAGESIZE,
+					       perm) < 0) {
+				page_decref(pa);
+				return -1;
+			}
+		}
 
-	// clear bss segment
-	while (end_va < memsz)
-		*((uint8_t *) end_va++) = 0;
+		// Copy through the kernel's identity mapping of the page.
+		pa = PTE_ADDR(*virtual_memory_lookup(pagedir, va));
+		if (lo < hi)
+			memcpy((uint8_t *) pa + (lo - va),
+			       image + ph->p_offset + (lo - ph->p_va), hi - lo);
+	}
+	return 0;
 }
 
 static void
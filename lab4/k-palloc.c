@@ -0,0 +1,254 @@
+#include "kernel.h"
+#include "x86.h"
+#include "lib.h"
+
+/*****************************************************************************
+ * k-palloc.c
+ *
+ *   The physical page allocator.
+ *
+ *   A binary buddy allocator manages physical memory from PALLOC_START up
+ *   to the top of RAM.  Memory is handed out in blocks of 2^order pages,
+ *   0 <= order <= PAGE_MAX_ORDER, each aligned to its own size.  A block's
+ *   "buddy" is the other half of the block of the next order up; when a
+ *   block is freed and its buddy is free too, the two merge, so free memory
+ *   never stays split into more pieces than outstanding allocations force.
+ *
+ *   Free blocks of each order sit on a doubly-linked list whose links are
+ *   stored in the free pages themselves.  The only other metadata is one
+ *   pageinfo_t per physical page, in an array carved out of the start of
+ *   the managed region at boot.
+ *
+ *   Single pages (order 0) also carry a reference count, for pages mapped
+ *   into more than one process: page_decref() frees a page when its last
+ *   reference goes away.
+ *
+ *****************************************************************************/
+
+typedef struct pageinfo {
+	int8_t pi_order;		// Order of the free block starting at
+					// this page, or -1 if this page does
+					// not start a free block
+	uint8_t pi_reserved;		// Nonzero if not managed here
+	uint16_t pi_refcount;		// References to an allocated page
+} pageinfo_t;
+
+typedef struct freeblock {
+	struct freeblock *fb_next;	// Stored in the first bytes of the
+	struct freeblock *fb_prev;	// free block itself
+} freeblock_t;
+
+static pageinfo_t *pageinfo;		// One entry per page of RAM
+static size_t npages;			// Number of pages of RAM
+static freeblock_t free_lists[PAGE_MAX_ORDER + 1];	// List heads
+static size_t nfree;			// Number of free pages
+
+#define PAGENUM(pa)		((pa) / PAGESIZE)
+#define PAGEADDR(pn)		((physaddr_t) (pn) * PAGESIZE)
+
+static void
+free_list_push(size_t pn, int order)
+{
+	freeblock_t *fb = (freeblock_t *) PAGEADDR(pn);
+	fb->fb_next = free_lists[order].fb_next;
+	fb->fb_prev = &free_lists[order];
+	fb->fb_next->fb_prev = fb;
+	free_lists[order].fb_next = fb;
+	pageinfo[pn].pi_order = order;
+}
+
+static void
+free_list_remove(size_t pn)
+{
+	freeblock_t *fb = (freeblock_t *) PAGEADDR(pn);
+	fb->fb_prev->fb_next = fb->fb_next;
+	fb->fb_next->fb_prev = fb->fb_prev;
+	pageinfo[pn].pi_order = -1;
+}
+
+// Free the block of 2^order pages starting at page 'pn', merging it with
+// its buddy for as long as the buddy is free too.
+static void
+block_free(size_t pn, int order)
+{
+	nfree += (size_t) 1 << order;
+	while (order < PAGE_MAX_ORDER) {
+		size_t buddy = pn ^ ((size_t) 1 << order);
+		if (buddy >= npages || pageinfo[buddy].pi_order != order)
+			break;
+		free_list_remove(buddy);
+		pn &= ~((size_t) 1 << order);
+		order++;
+	}
+	free_list_push(pn, order);
+}
+
+
+/*****************************************************************************
+ * page_alloc_init(ram_top)
+ *
+ *   Set up the allocator to manage physical memory [PALLOC_START, ram_top).
+ *   Called once at boot, before paging is turned on.
+ *
+ *****************************************************************************/
+
+void
+page_alloc_init(physaddr_t ram_top)
+{
+	size_t pn, first_free;
+	int order;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		free_lists[order].fb_next = free_lists[order].fb_prev
+			= &free_lists[order];
+
+	npages = PAGENUM(ram_top);
+	pageinfo = (pageinfo_t *) PALLOC_START;
+	memset(pageinfo, 0, npages * sizeof(pageinfo_t));
+
+	first_free = PAGENUM(ROUNDUP(PALLOC_START + npages * sizeof(pageinfo_t),
+				     PAGESIZE));
+	for (pn = 0; pn < npages; pn++) {
+		pageinfo[pn].pi_order = -1;
+		pageinfo[pn].pi_reserved = (pn < first_free);
+	}
+
+	// Hand the managed pages to the free lists in the largest aligned
+	// blocks that fit.
+	for (pn = first_free; pn < npages; pn += (size_t) 1 << order) {
+		for (order = PAGE_MAX_ORDER; order > 0; order--)
+			if ((pn & (((size_t) 1 << order) - 1)) == 0
+			    && pn + ((size_t) 1 << order) <= npages)
+				break;
+		block_free(pn, order);
+	}
+}
+
+
+/*****************************************************************************
+ * page_alloc(order)
+ *
+ *   Allocate a block of 2^order physically contiguous pages, aligned to
+ *   its size.  Returns the block's physical address, or 0 if no block that
+ *   large is free.  The memory is not cleared.  The first page's reference
+ *   count is set to 1.
+ *
+ * page_free(pa, order)
+ *
+ *   Free the block of 2^order pages at 'pa', which page_alloc(order)
+ *   returned.
+ *
+ *****************************************************************************/
+
+physaddr_t
+page_alloc(int order)
+{
+	int k;
+	size_t pn;
+
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return 0;
+	for (k = order; k <= PAGE_MAX_ORDER; k++)
+		if (free_lists[k].fb_next != &free_lists[k])
+			break;
+	if (k > PAGE_MAX_ORDER)
+		return 0;
+
+	pn = PAGENUM((physaddr_t) free_lists[k].fb_next);
+	free_list_remove(pn);
+
+	// Split the block, returning the upper halves to the free lists,
+	// until it is the requested size.
+	while (k > order) {
+		k--;
+		free_list_push(pn + ((size_t) 1 << k), k);
+	}
+
+	nfree -= (size_t) 1 << order;
+	pageinfo[pn].pi_refcount = 1;
+	return PAGEADDR(pn);
+}
+
+void
+page_free(physaddr_t pa, int order)
+{
+	size_t pn = PAGENUM(pa);
+	if (pa % PAGESIZE != 0 || pn >= npages || pageinfo[pn].pi_reserved
+	    || pageinfo[pn].pi_order >= 0)
+		kernel_panic("page_free: bad page %x!\n", pa);
+	pageinfo[pn].pi_refcount = 0;
+	block_free(pn, order);
+}
+
+
+/*****************************************************************************
+ * page_split(pa, order)
+ *
+ *   Turn the block of 2^order pages at 'pa', which page_alloc(order)
+ *   returned, into 2^order pages with reference counts of 1 each, which
+ *   can then be freed one at a time with page_decref().  Freed pages
+ *   still merge with their free buddies.
+ *
+ *****************************************************************************/
+
+void
+page_split(physaddr_t pa, int order)
+{
+	size_t pn = PAGENUM(pa), i;
+	for (i = 0; i < ((size_t) 1 << order); i++)
+		pageinfo[pn + i].pi_refcount = 1;
+}
+
+
+/*****************************************************************************
+ * page_incref(pa)
+ * page_decref(pa)
+ *
+ *   Add or drop a reference to the page at 'pa', which page_alloc(0)
+ *   returned.  Dropping the last reference frees the page.  Pages outside
+ *   the allocator's control, such as the console or the kernel image, are
+ *   ignored, so callers can apply these to any mapped page.
+ *
+ * page_refcount(pa)
+ *
+ *   Return the number of references to the page at 'pa', or 0 if the page
+ *   is not the allocator's.
+ *
+ * page_alloc_free_pages()
+ *
+ *   Return the number of free pages.
+ *
+ *****************************************************************************/
+
+void
+page_incref(physaddr_t pa)
+{
+	size_t pn = PAGENUM(pa);
+	if (pn < npages && !pageinfo[pn].pi_reserved)
+		pageinfo[pn].pi_refcount++;
+}
+
+void
+page_decref(physaddr_t pa)
+{
+	size_t pn = PAGENUM(pa);
+	if (pn < npages && !pageinfo[pn].pi_reserved
+	    && --pageinfo[pn].pi_refcount == 0)
+		block_free(pn, 0);
+}
+
+int
+page_refcount(physaddr_t pa)
+{
+	size_t pn = PAGENUM(pa);
+	if (pn < npages && !pageinfo[pn].pi_reserved)
+		return pageinfo[pn].pi_refcount;
+	else
+		return 0;
+}
+
+size_t
+page_alloc_free_pages(void)
+{
+	return nfree;
+}
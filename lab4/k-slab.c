@@ -0,0 +1,232 @@
+#include "kernel.h"
+#include "x86.h"
+#include "lib.h"
+
+/*****************************************************************************
+ * k-slab.c
+ *
+ *   The kernel object allocator.
+ *
+ *   Each kind of kernel object gets its own cache (slab_cache_t), which
+ *   carves single pages from the page allocator ("slabs") into equal-sized
+ *   objects.  A slab begins with a slab_t header; its free objects are
+ *   linked through their first word.  The cache keeps a list of partially
+ *   used slabs, so allocating or freeing is a few pointer operations: there
+ *   are no constructors, and objects come back uninitialized.  Freeing
+ *   finds an object's slab by rounding its address down to a page.
+ *
+ *   Slabs are "colored": successive slabs start their objects at different
+ *   multiples of SLAB_ALIGN, using up the space the objects leave over at
+ *   the end of the page.  Objects at the same index in different slabs then
+ *   fall into different cache sets, instead of all competing for one.
+ *
+ *   A cache holds on to at most one empty slab; any other slab that empties
+ *   goes back to the page allocator.
+ *
+ *   To export an allocation cost without reading the cycle counter on
+ *   every call, slab_alloc() times only one allocation in SLAB_COST_SAMPLE
+ *   and keeps a decayed average of those samples.
+ *
+ *****************************************************************************/
+
+#define SLAB_ALIGN		64	// Coloring granularity (a cache line)
+#define SLAB_COST_SAMPLE	64	// Time one allocation in this many
+
+struct slab {
+	slab_cache_t *sl_cache;		// The cache this slab belongs to
+	slab_t *sl_next;		// Links on the cache's partial list
+	slab_t *sl_prev;
+	void *sl_free;			// First free object
+	int sl_inuse;			// Number of allocated objects
+};
+
+// All caches, for slab_cache_stats()
+static slab_cache_t *slab_caches;
+
+
+/*****************************************************************************
+ * slab_cache_init(cache, name, size)
+ *
+ *   Set up 'cache' to allocate objects of 'size' bytes.  'name' is used
+ *   only for statistics.
+ *
+ *****************************************************************************/
+
+void
+slab_cache_init(slab_cache_t *cache, const char *name, size_t size)
+{
+	size_t avail = PAGESIZE - ROUNDUP(sizeof(slab_t), SLAB_ALIGN);
+	slab_cache_t **cp;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->sc_name = name;
+	cache->sc_size = ROUNDUP(MAX(size, sizeof(void *)), sizeof(void *));
+	if (cache->sc_size > avail)
+		kernel_panic("slab_cache_init: %s objects too large!\n", name);
+	cache->sc_objs_per_slab = avail / cache->sc_size;
+	cache->sc_ncolors = (avail % cache->sc_size) / SLAB_ALIGN + 1;
+
+	for (cp = &slab_caches; *cp; cp = &(*cp)->sc_next_cache)
+		/* do nothing */;
+	*cp = cache;
+}
+
+static void
+partial_push(slab_cache_t *cache, slab_t *s)
+{
+	s->sl_prev = NULL;
+	s->sl_next = cache->sc_partial;
+	if (s->sl_next)
+		s->sl_next->sl_prev = s;
+	cache->sc_partial = s;
+}
+
+static void
+partial_remove(slab_cache_t *cache, slab_t *s)
+{
+	if (s->sl_prev)
+		s->sl_prev->sl_next = s->sl_next;
+	else
+		cache->sc_partial = s->sl_next;
+	if (s->sl_next)
+		s->sl_next->sl_prev = s->sl_prev;
+}
+
+// Return a slab with no objects in use: the cache's spare empty slab if it
+// has one, otherwise a new one.
+static slab_t *
+slab_grow(slab_cache_t *cache)
+{
+	slab_t *s;
+	uint8_t *obj;
+	void **link;
+	int i;
+
+	if ((s = cache->sc_empty)) {
+		cache->sc_empty = NULL;
+		return s;
+	}
+	if (!(s = (slab_t *) page_alloc(0)))
+		return NULL;
+
+	s->sl_cache = cache;
+	s->sl_inuse = 0;
+	obj = (uint8_t *) s + ROUNDUP(sizeof(slab_t), SLAB_ALIGN)
+		+ cache->sc_color_next * SLAB_ALIGN;
+	if (++cache->sc_color_next == cache->sc_ncolors)
+		cache->sc_color_next = 0;
+
+	link = &s->sl_free;
+	for (i = 0; i < cache->sc_objs_per_slab; i++, obj += cache->sc_size) {
+		*link = obj;
+		link = (void **) obj;
+	}
+	*link = NULL;
+
+	cache->sc_nslabs++;
+	return s;
+}
+
+
+/*****************************************************************************
+ * slab_alloc(cache)
+ *
+ *   Allocate an object from 'cache'.  Returns NULL if out of memory.
+ *   The object's contents are undefined.
+ *
+ * slab_free(cache, obj)
+ *
+ *   Free 'obj', which slab_alloc(cache) returned.
+ *
+ *****************************************************************************/
+
+void *
+slab_alloc(slab_cache_t *cache)
+{
+	slab_t *s = cache->sc_partial;
+	bool_t timed = cache->sc_nallocs % SLAB_COST_SAMPLE == 0;
+	uint64_t start = timed ? read_cycle_counter() : 0;
+	void *obj;
+
+	if (!s) {
+		if (!(s = slab_grow(cache)))
+			return NULL;
+		partial_push(cache, s);
+	}
+
+	obj = s->sl_free;
+	s->sl_free = *(void **) obj;
+	s->sl_inuse++;
+	if (!s->sl_free)
+		partial_remove(cache, s);
+
+	cache->sc_inuse++;
+	cache->sc_nallocs++;
+	// Keep a decayed average, weighted 1/8 towards each new sample.
+	if (timed)
+		cache->sc_alloc_cycles +=
+			((int32_t) (read_cycle_counter() - start)
+			 - (int32_t) cache->sc_alloc_cycles) / 8;
+	return obj;
+}
+
+void
+slab_free(slab_cache_t *cache, void *obj)
+{
+	slab_t *s = (slab_t *) ROUNDDOWN((uintptr_t) obj, PAGESIZE);
+
+	if (s->sl_cache != cache)
+		kernel_panic("slab_free: %x is not a %s object!\n",
+			     obj, cache->sc_name);
+
+	if (!s->sl_free)
+		partial_push(cache, s);
+	*(void **) obj = s->sl_free;
+	s->sl_free = obj;
+	cache->sc_inuse--;
+	cache->sc_nfrees++;
+
+	if (--s->sl_inuse == 0) {
+		partial_remove(cache, s);
+		if (!cache->sc_empty)
+			cache->sc_empty = s;
+		else {
+			cache->sc_nslabs--;
+			page_free((physaddr_t) s, 0);
+		}
+	}
+}
+
+
+/*****************************************************************************
+ * slab_cache_stats(index, ss)
+ *
+ *   Fill in '*ss' with statistics for cache number 'index', counting in the
+ *   order the caches were initialized.  Returns 0, or -1 if there is no
+ *   such cache.
+ *
+ *****************************************************************************/
+
+int
+slab_cache_stats(int index, slabstats_t *ss)
+{
+	slab_cache_t *cache = slab_caches;
+	int i;
+
+	for (; cache && index > 0; index--)
+		cache = cache->sc_next_cache;
+	if (!cache || index < 0)
+		return -1;
+
+	for (i = 0; i < (int) sizeof(ss->ss_name) - 1 && cache->sc_name[i]; i++)
+		ss->ss_name[i] = cache->sc_name[i];
+	ss->ss_name[i] = '\0';
+	ss->ss_objsize = cache->sc_size;
+	ss->ss_objs_per_slab = cache->sc_objs_per_slab;
+	ss->ss_nslabs = cache->sc_nslabs;
+	ss->ss_inuse = cache->sc_inuse;
+	ss->ss_nallocs = cache->sc_nallocs;
+	ss->ss_nfrees = cache->sc_nfrees;
+	ss->ss_alloc_cycles = cache->sc_alloc_cycles;
+	return 0;
+}
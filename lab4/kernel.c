@@ -11,37 +11,57 @@
  *
  *****************************************************************************/
 
-// The program loader loads 4 processes, starting at PROC1_START, allocating
-// 1 MB to each process.
-// Each process's stack grows down from the top of its memory space.
-// (But note that SchedOS processes, like MiniprocOS processes, are not fully
-// isolated: any process could modify any part of memory.)
-
-#define NPROCS		5
-#define PROC1_START	0x200000
-#define PROC_SIZE	0x100000
-
-// +---------+-----------------------+--------+---------------------+---------/
-// | Base    | Kernel         Kernel | Shared | App 0         App 0 | App 1
-// | Memory  | Code + Data     Stack | Data   | Code + Data   Stack | Code ...
-// +---------+-----------------------+--------+---------------------+---------/
-// 0x0    0x100000               0x198000 0x200000              0x300000
+// Physical memory is handed out by the page allocator (k-palloc.c), page
+// by page, as processes need it.  Each process has its own page directory,
+// which maps its program and stack at virtual addresses between
+// PROC_VA_START and PROC_VA_END, plus the console and the shared data
+// described below; other processes' memory and the kernel are off limits.
+
+#define NPROCS		16
+
+// Physical memory:
+// +---------+-----------------------+--------+------------------------/
+// | Base    | Kernel         Kernel | Shared | Page allocator: page
+// | Memory  | Code + Data     Stack | Data   | tables, process memory
+// +---------+-----------------------+--------+------------------------/
+// 0x0    0x100000               0x198000 0x200000            top of RAM
 //
-// The program loader puts each application's starting instruction pointer
-// at the very top of its stack.
+// Process virtual memory:
+// +------------------------+---------------------------------+-------+
+// | Kernel, console, and   | App Code + Data (at the         | App   |
+// | shared data (identity) | addresses its ELF file names)   | Stack |
+// +------------------------+---------------------------------+-------+
+// 0x0               PROC_VA_START                          PROC_VA_END
+//
+// Each application's stack grows down from PROC_VA_END.  Shared memory
+// segments (sys_shm_attach()) are mapped upwards from PROC_SHM_START.
 //
 // System-wide global variables shared among the kernel and the four
 // applications are stored in memory from 0x198000 to 0x200000.  Currently
-// there is just one variable there, 'cursorpos', which occupies the four
-// bytes of memory 0x198000-0x198003.  You can add more variables by defining
-// their addresses in link/shared.ld; make sure they do not overlap!
+// there are two variables there: 'cursorpos', which occupies the four
+// bytes of memory 0x198000-0x198003, and the kernel data page 'kerneldata',
+// at 0x199000.  You can add more variables by defining their addresses in
+// link/shared.ld; make sure they do not overlap!
 
 
 // A process descriptor for each process.
-// Note that proc_array[0] is never used.
+// Note that proc_array[0] is not an application: it is the idle process,
+// which schedule() runs only when nothing else is runnable.
 // The first application process descriptor is proc_array[1].
 static process_t proc_array[NPROCS];
 
+// Process snapshots (see sys_snapshot() in process.h), allocated from
+// 'snapshot_cache'.  IDs start at 1 and are never reused.
+static slab_cache_t snapshot_cache;
+static snapshot_t *snapshots;
+static int snapshot_next_id = 1;
+
+// Shared memory segments (see sys_shm_create() in process.h), allocated
+// from 'shm_cache'.  IDs start at 1 and are never reused.
+static slab_cache_t shm_cache;
+static shm_t *shms;
+static int shm_next_id = 1;
+
 // A pointer to the currently running process.
 // This is kept up to date by the run() function, in x86.c.
 process_t *current;
@@ -49,6 +69,30 @@ process_t *current;
 // The preferred scheduling algorithm.
 int scheduling_algorithm;
 
+// Load tracking, updated on every clock tick by load_update().
+// 'load_avg' holds the 1-, 5-, and 15-second system load averages; see
+// schedos.h for the fixed-point format.
+static uint32_t ticks;
+static uint32_t load_avg[3];
+
+// Decay factors exp(-1/N) for windows of N = HZ, 5*HZ, and 15*HZ ticks,
+// in LOAD_FSHIFT fixed point.
+static const uint32_t load_exp[3] = { 64884, 65405, 65492 };
+
+static void load_update(void);
+static void bandwidth_update(void);
+static process_t *process_alloc(void);
+static process_t *process_launch(int program);
+static int snapshot_take(process_t *proc);
+static process_t *snapshot_launch(int id);
+static int snapshot_free(int id);
+static int shm_create(size_t size);
+static uintptr_t shm_attach(process_t *proc, int id);
+static int shm_destroy(int id);
+static pagedirectory_t process_pagedir_create(void);
+static int process_stack_alloc(process_t *proc);
+static void process_memory_free(process_t *proc);
+
 
 /*****************************************************************************
  * start
@@ -62,10 +106,19 @@ void
 start(void)
 {
     int i;
+    physaddr_t ram_top;
 
-    // Set up hardware (x86.c)
+    // Set up hardware (x86.c) and the page allocator (k-palloc.c).  The
+    // clock interrupts HZ times a second; each tick drives load tracking,
+    // CPU bandwidth limits, and preemption (see INT_CLOCK in interrupt()).
     segments_init();
-    interrupt_controller_init(0);
+    interrupt_controller_init(1);
+    fpu_init();
+    ram_top = MIN(physical_memory_size(), (physaddr_t) PROC_VA_START);
+    page_alloc_init(ram_top);
+    virtual_memory_init(ram_top);
+    slab_cache_init(&snapshot_cache, "snapshot", sizeof(snapshot_t));
+    slab_cache_init(&shm_cache, "shm", sizeof(shm_t));
     console_clear();
 
     // Initialize process descriptors as empty
@@ -77,31 +130,40 @@ start(void)
         proc_array[i].p_share = 1;
     }
 
-    // Set up process descriptors (the proc_array[])
-    for (i = 1; i < NPROCS; i++) {
-        process_t *proc = &proc_array[i];
-        uint32_t stack_ptr = PROC1_START + i * PROC_SIZE;
-
-        // Initialize the process descriptor
-        special_registers_init(proc);
-
-        // Set ESP
-        proc->p_registers.reg_esp = stack_ptr;
-
-        // Load process and set EIP, based on ELF image
-        program_loader(i - 1, &proc->p_registers.reg_eip);
-
-        // Mark the process as runnable!
-        proc->p_state = P_RUNNABLE;
-    }
+    // Set up the idle process.  It never appears runnable to the
+    // scheduling algorithms; schedule() picks it explicitly.
+    special_registers_init(&proc_array[0]);
+    proc_array[0].p_registers.reg_eip = (uint32_t) idle_loop;
+    proc_array[0].p_pagedir = pagedir_create();
+    if (!proc_array[0].p_pagedir
+        || virtual_memory_map(proc_array[0].p_pagedir, (uintptr_t) idle_loop,
+                              (physaddr_t) idle_loop, PAGESIZE, PTE_U) < 0)
+        kernel_panic("Out of memory for the idle process!\n");
+    proc_array[0].p_state = P_BLOCKED;
+
+    // Start one process for each program: process i runs program i
+    for (i = 1; i <= program_count(); i++)
+        if (!process_launch(i))
+            kernel_panic("Out of memory for process %d!\n", i);
 
     // Initialize the cursor-position shared variable to point to the
     // console's first character (the upper left).
     cursorpos = (uint16_t *) 0xB8000;
 
+    // Initialize the kernel data page.
+    memset((void *) &kerneldata, 0, sizeof(kerneldata));
+    kerneldata.kd_tsc_khz = cycle_counter_calibrate();
+
     // Initialize the scheduling algorithm.
     scheduling_algorithm = 0;
 
+#ifdef SCHEDOS_BENCHMARK
+    // Run the kernel benchmarks (k-bench.c) instead of the processes.
+    benchmarks_run();
+    while (1)
+        /* do nothing */;
+#endif
+
     // Switch to the first process.
     run(&proc_array[1]);
 
@@ -116,7 +178,7 @@ start(void)
  * interrupt
  *
  *   This is the weensy interrupt and system call handler.
- *   The current handler handles 4 different system calls (two of which
+ *   The current handler handles 15 different system calls (two of which
  *   do nothing), plus the clock interrupt.
  *
  *   Note that we will never receive clock interrupts while in the kernel.
@@ -136,11 +198,30 @@ interrupt(registers_t *reg)
         // the next process.
         schedule();
 
+    case INT_SYS_YIELD_TO: {
+        // 'sys_yield_to' switches directly to process %eax, bypassing
+        // the scheduling algorithm.  The target inherits the rest of the
+        // caller's quantum: the next clock tick, and thus load and
+        // bandwidth accounting, is charged to whoever is running when it
+        // fires.  For algorithm 3, the handoff uses up one of the target's
+        // p_share turns, just as if schedule() had picked it.
+        pid_t pid = current->p_registers.reg_eax;
+        if (pid <= 0 || pid >= NPROCS || pid == current->p_pid
+            || proc_array[pid].p_state != P_RUNNABLE) {
+            current->p_registers.reg_eax = -1;
+            run(current);
+        }
+        current->p_registers.reg_eax = 0;
+        proc_array[pid].p_timer++;
+        run(&proc_array[pid]);
+    }
+
     case INT_SYS_EXIT:
         // 'sys_exit' exits the current process: it is marked as
         // non-runnable.
         current->p_state = P_ZOMBIE;
         current->p_exit_status = current->p_registers.reg_eax;
+        process_memory_free(current);
         schedule();
 
     case INT_SYS_USER1:
@@ -153,10 +234,152 @@ interrupt(registers_t *reg)
         /* Your code here (if you want). */
         run(current);
 
+    case INT_SYS_LOADAVG: {
+        // 'sys_loadavg' copies the load averages of the system and of
+        // process %eax (or of the caller, if %eax is 0) into the
+        // loadavg_t that %ebx points to.
+        pid_t pid = current->p_registers.reg_eax;
+        loadavg_t *la = (loadavg_t *) current->p_registers.reg_ebx;
+        if (pid == 0)
+            pid = current->p_pid;
+        if (pid <= 0 || pid >= NPROCS || proc_array[pid].p_state == P_EMPTY
+            || !virtual_memory_check(current->p_pagedir, (uintptr_t) la,
+                                     sizeof(*la), PTE_U | PTE_W))
+            current->p_registers.reg_eax = -1;
+        else {
+            int i, nrunnable = 0;
+            for (i = 1; i < NPROCS; i++)
+                nrunnable += (proc_array[i].p_state == P_RUNNABLE);
+            la->la_ticks = ticks;
+            la->la_nrunnable = nrunnable;
+            for (i = 0; i < 3; i++)
+                la->la_load[i] = load_avg[i];
+            la->la_runnable_avg = proc_array[pid].p_runnable_avg;
+            la->la_running_avg = proc_array[pid].p_running_avg;
+            current->p_registers.reg_eax = 0;
+        }
+        run(current);
+    }
+
+    case INT_SYS_BANDWIDTH: {
+        // 'sys_set_bandwidth' limits process %eax (or the caller, if
+        // %eax is 0) to %ebx ticks of CPU time every %ecx ticks.
+        pid_t pid = current->p_registers.reg_eax;
+        int quota = current->p_registers.reg_ebx;
+        int period = current->p_registers.reg_ecx;
+        if (pid == 0)
+            pid = current->p_pid;
+        if (pid <= 0 || pid >= NPROCS || proc_array[pid].p_state == P_EMPTY
+            || quota < 0 || (quota > 0 && (period <= 0 || quota > period)))
+            current->p_registers.reg_eax = -1;
+        else {
+            process_t *p = &proc_array[pid];
+            p->p_quota = quota;
+            p->p_period = (quota > 0 ? period : 0);
+            p->p_quota_used = 0;
+            p->p_period_left = p->p_period;
+            if (p->p_throttled) {
+                p->p_throttled = 0;
+                p->p_state = P_RUNNABLE;
+            }
+            current->p_registers.reg_eax = 0;
+        }
+        run(current);
+    }
+
+    case INT_SYS_LAUNCH: {
+        // 'sys_launch' starts a new process running program %eax, and
+        // returns its process ID.
+        process_t *proc = process_launch(current->p_registers.reg_eax);
+        current->p_registers.reg_eax = (proc ? proc->p_pid : -1);
+        run(current);
+    }
+
+    case INT_SYS_SNAPSHOT:
+        // 'sys_snapshot' saves a snapshot of the current process, and
+        // returns its ID.
+        current->p_registers.reg_eax = snapshot_take(current);
+        run(current);
+
+    case INT_SYS_SNAPSHOT_LAUNCH: {
+        // 'sys_snapshot_launch' starts a new process from snapshot %eax,
+        // and returns its process ID.
+        process_t *proc = snapshot_launch(current->p_registers.reg_eax);
+        current->p_registers.reg_eax = (proc ? proc->p_pid : -1);
+        run(current);
+    }
+
+    case INT_SYS_SNAPSHOT_FREE:
+        // 'sys_snapshot_free' discards snapshot %eax.
+        current->p_registers.reg_eax =
+            snapshot_free(current->p_registers.reg_eax);
+        run(current);
+
+    case INT_SYS_SHM_CREATE:
+        // 'sys_shm_create' creates a shared memory segment of %eax bytes,
+        // and returns its ID.
+        current->p_registers.reg_eax =
+            shm_create(current->p_registers.reg_eax);
+        run(current);
+
+    case INT_SYS_SHM_ATTACH:
+        // 'sys_shm_attach' maps shared memory segment %eax into the
+        // current process, and returns its address.
+        current->p_registers.reg_eax =
+            shm_attach(current, current->p_registers.reg_eax);
+        run(current);
+
+    case INT_SYS_SHM_DESTROY:
+        // 'sys_shm_destroy' removes shared memory segment %eax.
+        current->p_registers.reg_eax =
+            shm_destroy(current->p_registers.reg_eax);
+        run(current);
+
+    case INT_SYS_SLABSTATS: {
+        // 'sys_slab_stats' copies the statistics of kernel object cache
+        // %eax into the slabstats_t that %ebx points to.
+        slabstats_t *ss = (slabstats_t *) current->p_registers.reg_ebx;
+        if (!virtual_memory_check(current->p_pagedir, (uintptr_t) ss,
+                                  sizeof(*ss), PTE_U | PTE_W))
+            current->p_registers.reg_eax = -1;
+        else
+            current->p_registers.reg_eax =
+                slab_cache_stats(current->p_registers.reg_eax, ss);
+        run(current);
+    }
+
+    case INT_PAGEFAULT: {
+        // A process touched memory its page directory does not let it
+        // access.  If the page is demand-zero or copy-on-write, fix it up
+        // and let the process retry; otherwise, kill the process.  (The
+        // kernel itself should never fault.)
+        uint32_t addr = rcr2();
+        if (!(reg->reg_err & PFERR_USER))
+            kernel_panic("Kernel page fault at %x, eip %x!\n",
+                         addr, reg->reg_eip);
+        if (virtual_memory_fault(current->p_pagedir, addr,
+                                 reg->reg_err & PFERR_WRITE) == 0)
+            run(current);
+        cursorpos = console_printf(cursorpos, 0x0C00,
+                                   "\nProcess %d: page fault at %x, eip %x\n",
+                                   current->p_pid, addr, reg->reg_eip);
+        current->p_state = P_ZOMBIE;
+        current->p_exit_status = -1;
+        process_memory_free(current);
+        schedule();
+    }
+
+    case INT_FPU:
+        // A process used the FPU while another process's state was in it.
+        fpu_trap();
+        run(current);
+
     case INT_CLOCK:
         // A clock interrupt occurred (so an application exhausted its
         // time quantum).
-        // Switch to the next runnable process.
+        // Account for the tick, then switch to the next runnable process.
+        load_update();
+        bandwidth_update();
         schedule();
 
     default:
@@ -168,12 +391,478 @@ interrupt(registers_t *reg)
 
 
 
+/*****************************************************************************
+ * process_alloc
+ *
+ *   Return a cleared process descriptor for a new process, or NULL if
+ *   there is none free.  Since SchedOS has no sys_wait(), exited
+ *   processes' descriptors count as free.  The caller gives the process a
+ *   page directory and registers, then marks it runnable.
+ *
+ * process_launch(program)
+ *
+ *   Start a new process running program number 'program' (p-schedos-app-N
+ *   is program N).  Every process has its own address space, and all
+ *   programs are linked at the same address, so one program image can run
+ *   in any number of processes at once.  Returns the new process, or NULL
+ *   if there is no such program or no room for the process.
+ *
+ * process_pagedir_create
+ *
+ *   Create a page directory for a new process.  Besides the kernel's own
+ *   (kernel-only) mappings, every process can use the console, the shared
+ *   data page holding 'cursorpos', and, read-only, the kernel data page.
+ *   The caller maps the process's own memory.  Returns NULL if out of
+ *   memory.
+ *
+ *****************************************************************************/
+
+static process_t *
+process_alloc(void)
+{
+    pid_t pid;
+    process_t *proc;
+
+    for (pid = 1; pid < NPROCS; pid++)
+        if (proc_array[pid].p_state == P_EMPTY
+            || proc_array[pid].p_state == P_ZOMBIE)
+            break;
+    if (pid == NPROCS)
+        return NULL;
+
+    proc = &proc_array[pid];
+    memset(proc, 0, sizeof(*proc));
+    proc->p_pid = pid;
+    proc->p_share = 1;
+    proc->p_shm_next = PROC_SHM_START;
+    return proc;
+}
+
+static process_t *
+process_launch(int program)
+{
+    process_t *proc;
+
+    if (program < 1 || program > program_count()
+        || !(proc = process_alloc()))
+        return NULL;
+    special_registers_init(proc);
+
+    // Give it a page directory, load the program into it and set EIP,
+    // based on ELF image, then give it a stack and set ESP
+    if (!(proc->p_pagedir = process_pagedir_create()))
+        return NULL;
+    if (program_loader(program - 1, proc->p_pagedir,
+                       &proc->p_registers.reg_eip) < 0
+        || process_stack_alloc(proc) < 0) {
+        pagedir_free(proc->p_pagedir);
+        proc->p_pagedir = NULL;
+        return NULL;
+    }
+
+    // Mark the process as runnable!
+    proc->p_state = P_RUNNABLE;
+    return proc;
+}
+
+static pagedirectory_t
+process_pagedir_create(void)
+{
+    pagedirectory_t pagedir = pagedir_create();
+    if (pagedir
+        && (virtual_memory_map(pagedir, (uintptr_t) CONSOLE_BEGIN,
+                               (physaddr_t) CONSOLE_BEGIN,
+                               (CONSOLE_END - CONSOLE_BEGIN) * sizeof(uint16_t),
+                               PTE_U | PTE_W) < 0
+            || virtual_memory_map(pagedir, (uintptr_t) &cursorpos,
+                                  (physaddr_t) &cursorpos, sizeof(cursorpos),
+                                  PTE_U | PTE_W) < 0
+            || virtual_memory_map(pagedir, (uintptr_t) &kerneldata,
+                                  (physaddr_t) &kerneldata, sizeof(kerneldata),
+                                  PTE_U) < 0)) {
+        pagedir_free(pagedir);
+        pagedir = NULL;
+    }
+    return pagedir;
+}
+
+
+
+/*****************************************************************************
+ * process_stack_alloc
+ *
+ *   Give 'proc' a PROC_STACK_SIZE-byte stack at the top of its process
+ *   memory, and point its ESP at the top.  The stack pages are demand-zero,
+ *   so they use memory only once touched.  Returns 0 on success, -1 if out
+ *   of memory.
+ *
+ * process_memory_free
+ *
+ *   Free the page directory of exited process 'proc', all the memory it
+ *   mapped for the process, and its FPU state.
+ *
+ *****************************************************************************/
+
+static int
+process_stack_alloc(process_t *proc)
+{
+    if (virtual_memory_map(proc->p_pagedir, PROC_VA_END - PROC_STACK_SIZE, 0,
+                           PROC_STACK_SIZE, PTE_U | PTE_W | PTE_ZERO) < 0)
+        return -1;
+    proc->p_registers.reg_esp = PROC_VA_END;
+    return 0;
+}
+
+static void
+process_memory_free(process_t *proc)
+{
+    // Stop using the page directory before freeing it.
+    if (rcr3() == proc->p_pagedir)
+        lcr3(kernel_pagedir);
+    pagedir_free(proc->p_pagedir);
+    proc->p_pagedir = NULL;
+    fpu_release(proc);
+}
+
+
+
+/*****************************************************************************
+ * snapshot_take(proc)
+ *
+ *   Save a snapshot of 'proc', which is in a system call: copy-on-write
+ *   copies of its memory, its registers, with the system call's return
+ *   value set to 0, and its FPU state.  Returns the new snapshot's ID, or -1 if out of memory.
+ *
+ * snapshot_launch(id)
+ *
+ *   Start a new process from snapshot 'id'.  The process gets its own
+ *   copy-on-write copy of the snapshot's memory, so nothing is copied but
+ *   page tables, and only the pages the process then writes get copied
+ *   later.  Returns the new process, or NULL if there is no such snapshot
+ *   or no room for the process.
+ *
+ * snapshot_free(id)
+ *
+ *   Discard snapshot 'id' and drop its references to memory.  Returns 0,
+ *   or -1 if there is no such snapshot.
+ *
+ *****************************************************************************/
+
+static int
+snapshot_take(process_t *proc)
+{
+    snapshot_t *sn = slab_alloc(&snapshot_cache);
+    if (!sn)
+        return -1;
+    if (!(sn->sn_pagedir = pagedir_fork(proc->p_pagedir))) {
+        slab_free(&snapshot_cache, sn);
+        return -1;
+    }
+    sn->sn_registers = proc->p_registers;
+    sn->sn_registers.reg_eax = 0;
+    sn->sn_shm_next = proc->p_shm_next;
+    fpu_sync(proc);
+    sn->sn_fpu_used = proc->p_fpu_used;
+    if (proc->p_fpu_used)
+        sn->sn_fpu = proc->p_fpu;
+    sn->sn_id = snapshot_next_id++;
+    sn->sn_next = snapshots;
+    snapshots = sn;
+    return sn->sn_id;
+}
+
+static process_t *
+snapshot_launch(int id)
+{
+    snapshot_t *sn;
+    process_t *proc;
+
+    for (sn = snapshots; sn && sn->sn_id != id; sn = sn->sn_next)
+        /* do nothing */;
+    if (!sn || !(proc = process_alloc()))
+        return NULL;
+    if (!(proc->p_pagedir = pagedir_fork(sn->sn_pagedir)))
+        return NULL;
+    proc->p_registers = sn->sn_registers;
+    proc->p_shm_next = sn->sn_shm_next;
+    proc->p_fpu_used = sn->sn_fpu_used;
+    if (sn->sn_fpu_used)
+        proc->p_fpu = sn->sn_fpu;
+    proc->p_state = P_RUNNABLE;
+    return proc;
+}
+
+static int
+snapshot_free(int id)
+{
+    snapshot_t **snp, *sn;
+
+    for (snp = &snapshots; *snp && (*snp)->sn_id != id; snp = &(*snp)->sn_next)
+        /* do nothing */;
+    if (!(sn = *snp))
+        return -1;
+    *snp = sn->sn_next;
+    pagedir_free(sn->sn_pagedir);
+    slab_free(&snapshot_cache, sn);
+    return 0;
+}
+
+
+
+/*****************************************************************************
+ * shm_create(size)
+ *
+ *   Create a shared memory segment of 'size' bytes, rounded up to whole
+ *   pages, and return its ID, or -1 if 'size' is 0 or too large or if out
+ *   of memory.  The pages come from one buddy block, cleared, then split
+ *   so that each page is reference counted on its own: the segment holds
+ *   one reference to each page, and each process that attaches it another.
+ *   Pages the block has beyond the segment's end are freed at once.
+ *
+ * shm_attach(proc, id)
+ *
+ *   Map segment 'id' into 'proc' at its next free shared memory address,
+ *   and return that address, or 0 if there is no such segment or no room.
+ *   The pages are marked PTE_SHARED, so that snapshots keep sharing them
+ *   instead of making them copy-on-write.  pagedir_free() drops the
+ *   process's references when it exits.  A segment made of whole 4 MB
+ *   blocks (a 4 MB segment is one buddy block, so it is aligned) is
+ *   mapped at a PTSIZE-aligned address with 4 MB pages, where the
+ *   processor has them, so it costs no page tables and few TLB entries.
+ *
+ * shm_destroy(id)
+ *
+ *   Remove segment 'id' and drop its references to its pages.  Returns 0,
+ *   or -1 if there is no such segment.
+ *
+ *****************************************************************************/
+
+static int
+shm_create(size_t size)
+{
+    shm_t *shm;
+    size_t i, npages = ROUNDUP(size, PAGESIZE) / PAGESIZE;
+    int order = 0;
+
+    if (size == 0 || size > ((size_t) PAGESIZE << PAGE_MAX_ORDER))
+        return -1;
+    while (((size_t) 1 << order) < npages)
+        order++;
+    if (!(shm = slab_alloc(&shm_cache)))
+        return -1;
+    if (!(shm->shm_pa = page_alloc(order))) {
+        slab_free(&shm_cache, shm);
+        return -1;
+    }
+
+    memset((void *) shm->shm_pa, 0, npages * PAGESIZE);
+    page_split(shm->shm_pa, order);
+    for (i = npages; i < ((size_t) 1 << order); i++)
+        page_decref(shm->shm_pa + i * PAGESIZE);
+
+    shm->shm_npages = npages;
+    shm->shm_id = shm_next_id++;
+    shm->shm_next = shms;
+    shms = shm;
+    return shm->shm_id;
+}
+
+static uintptr_t
+shm_attach(process_t *proc, int id)
+{
+    shm_t *shm;
+    uintptr_t va = proc->p_shm_next;
+    size_t i, size;
+    bool_t large;
+
+    for (shm = shms; shm && shm->shm_id != id; shm = shm->shm_next)
+        /* do nothing */;
+    if (!shm)
+        return 0;
+    size = shm->shm_npages * PAGESIZE;
+    if ((large = (size % PTSIZE == 0 && shm->shm_pa % PTSIZE == 0)))
+        va = ROUNDUP(va, PTSIZE);
+    if (size > PROC_SHM_END - va)
+        return 0;
+
+    // Claim the address range first, so a mapping that runs out of memory
+    // partway is never mapped over later.
+    proc->p_shm_next = va + size;
+    if (large && virtual_memory_map(proc->p_pagedir, va, shm->shm_pa, size,
+                                    PTE_U | PTE_W | PTE_SHARED | PTE_PS) == 0) {
+        for (i = 0; i < shm->shm_npages; i++)
+            page_incref(shm->shm_pa + i * PAGESIZE);
+        return va;
+    }
+    for (i = 0; i < shm->shm_npages; i++) {
+        physaddr_t pa = shm->shm_pa + i * PAGESIZE;
+        if (virtual_memory_map(proc->p_pagedir, va + i * PAGESIZE, pa,
+                               PAGESIZE, PTE_U | PTE_W | PTE_SHARED) < 0)
+            return 0;
+        page_incref(pa);
+    }
+    return va;
+}
+
+static int
+shm_destroy(int id)
+{
+    shm_t **shmp, *shm;
+    size_t i;
+
+    for (shmp = &shms; *shmp && (*shmp)->shm_id != id;
+         shmp = &(*shmp)->shm_next)
+        /* do nothing */;
+    if (!(shm = *shmp))
+        return -1;
+    *shmp = shm->shm_next;
+    for (i = 0; i < shm->shm_npages; i++)
+        page_decref(shm->shm_pa + i * PAGESIZE);
+    slab_free(&shm_cache, shm);
+    return 0;
+}
+
+
+
+/*****************************************************************************
+ * kernel_panic
+ *
+ *   Print an error message on the console and stop.
+ *
+ *****************************************************************************/
+
+void
+kernel_panic(const char *format, ...)
+{
+    va_list val;
+    va_start(val, format);
+    cursorpos = console_vprintf(cursorpos, 0x0C00, format, val);
+    va_end(val);
+    while (1)
+        /* do nothing */;
+}
+
+
+
+/*****************************************************************************
+ * load_update
+ *
+ *   Called once per clock tick.  Folds this tick into the exponentially
+ *   decayed load averages:
+ *
+ *      avg = avg * e + sample * (1 - e),   where e = exp(-1/window)
+ *
+ *   The system load samples the number of runnable processes.  Each
+ *   process's averages sample whether it was runnable, and whether it was
+ *   the one running, during the tick.
+ *
+ *****************************************************************************/
+
+static uint32_t
+calc_load(uint32_t avg, uint32_t exp, uint32_t sample)
+{
+    uint64_t x = (uint64_t) avg * exp
+        + (uint64_t) sample * (LOAD_FIXED_1 - exp)
+        + (1 << (LOAD_FSHIFT - 1));
+    return (uint32_t) (x >> LOAD_FSHIFT);
+}
+
+static void
+load_update(void)
+{
+    int i;
+    uint32_t nrunnable = 0;
+
+    ticks++;
+    current->p_runtime++;
+    for (i = 1; i < NPROCS; i++) {
+        process_t *p = &proc_array[i];
+        uint32_t runnable = (p->p_state == P_RUNNABLE);
+        nrunnable += runnable;
+        p->p_runnable_avg = calc_load(p->p_runnable_avg, load_exp[0],
+                                      runnable * LOAD_FIXED_1);
+        p->p_running_avg = calc_load(p->p_running_avg, load_exp[0],
+                                     (p == current) * LOAD_FIXED_1);
+    }
+
+    for (i = 0; i < 3; i++)
+        load_avg[i] = calc_load(load_avg[i], load_exp[i],
+                                nrunnable * LOAD_FIXED_1);
+}
+
+
+
+/*****************************************************************************
+ * kerneldata_update
+ *
+ *   Called by run() just before 'proc' runs.  Refreshes the kernel data
+ *   page (see schedos.h) with the system's and 'proc's current state.
+ *
+ *****************************************************************************/
+
+void
+kerneldata_update(process_t *proc)
+{
+    int i, nrunnable = 0;
+
+    for (i = 1; i < NPROCS; i++)
+        nrunnable += (proc_array[i].p_state == P_RUNNABLE);
+
+    kerneldata.kd_pid = proc->p_pid;
+    kerneldata.kd_ticks = ticks;
+    kerneldata.kd_nrunnable = nrunnable;
+    kerneldata.kd_runtime = proc->p_runtime;
+    kerneldata.kd_runnable_avg = proc->p_runnable_avg;
+    kerneldata.kd_running_avg = proc->p_running_avg;
+}
+
+
+
+/*****************************************************************************
+ * bandwidth_update
+ *
+ *   Called once per clock tick.  Charges the tick to the current process
+ *   and throttles it (marks it blocked) once it has used up its quota for
+ *   the period.  When a process's period ends, its quota is replenished and,
+ *   if it was throttled, it becomes runnable again.
+ *
+ *****************************************************************************/
+
+static void
+bandwidth_update(void)
+{
+    int i;
+
+    for (i = 1; i < NPROCS; i++) {
+        process_t *p = &proc_array[i];
+        if (p->p_period == 0 || p->p_state == P_EMPTY)
+            continue;
+
+        if (p == current && p->p_state == P_RUNNABLE
+            && ++p->p_quota_used >= p->p_quota) {
+            p->p_state = P_BLOCKED;
+            p->p_throttled = 1;
+        }
+
+        if (--p->p_period_left <= 0) {
+            p->p_period_left = p->p_period;
+            p->p_quota_used = 0;
+            if (p->p_throttled) {
+                p->p_throttled = 0;
+                p->p_state = P_RUNNABLE;
+            }
+        }
+    }
+}
+
+
+
 /*****************************************************************************
  * schedule
  *
  *   This is the weensy process scheduler.
  *   It picks a runnable process, then context-switches to that process.
- *   If there are no runnable processes, it spins forever.
+ *   If there are no runnable processes, it runs the idle process.
  *
  *   This function implements multiple scheduling algorithms, depending on
  *   the value of 'scheduling_algorithm'.  We've provided one; in the problem
@@ -185,6 +874,15 @@ void
 schedule(void)
 {
     pid_t pid = current->p_pid;
+    int i;
+
+    // If every process is blocked (for instance, throttled by its CPU
+    // bandwidth limit), idle until the next clock interrupt.
+    for (i = 1; i < NPROCS; i++)
+        if (proc_array[i].p_state == P_RUNNABLE)
+            break;
+    if (i == NPROCS)
+        run(&proc_array[0]);
 
     if (scheduling_algorithm == 0)
         while (1) {
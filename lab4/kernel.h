@@ -28,13 +28,52 @@ typedef struct process {
 					// stack location, EIP, etc.
 					// 'registers_t' defined in x86.h
 
+	pagedirectory_t p_pagedir;	// Process's page directory
+
 	procstate_t p_state;		// Process state; see above
 	int p_exit_status;		// Process's exit status
     int p_priority;
     int p_share;
     int p_timer;
+
+    uint32_t p_runnable_avg;		// Decayed load averages; see loadavg_t
+    uint32_t p_running_avg;		// in schedos.h
+    uint32_t p_runtime;			// Clock ticks charged to this process
+
+    int p_quota;			// CPU bandwidth limit: run at most
+    int p_period;			// p_quota ticks every p_period ticks
+					// (p_period == 0 means no limit)
+    int p_quota_used;			// Ticks run in the current period
+    int p_period_left;			// Ticks left in the current period
+    bool_t p_throttled;			// Blocked for exceeding p_quota
+
+	uintptr_t p_shm_next;		// Where the next shared memory
+					// segment will attach
+
+	fpustate_t p_fpu;		// Saved FPU state (see fpu_init())
+	bool_t p_fpu_used;		// Has the process used the FPU?
 } process_t;
 
+// A process snapshot: a frozen copy of a process's memory and registers,
+// from which sys_snapshot_launch() starts new processes
+typedef struct snapshot {
+	int sn_id;			// Snapshot ID
+	pagedirectory_t sn_pagedir;	// Copy-on-write copy of the memory
+	registers_t sn_registers;	// Registers to start instances with
+	uintptr_t sn_shm_next;		// Instances' p_shm_next
+	fpustate_t sn_fpu;		// Instances' FPU state, and whether
+	bool_t sn_fpu_used;		// they start with it
+	struct snapshot *sn_next;	// Next snapshot
+} snapshot_t;
+
+// A shared memory segment; see sys_shm_create()
+typedef struct shm {
+	int shm_id;			// Segment ID
+	physaddr_t shm_pa;		// Physical address of its pages
+	size_t shm_npages;		// Number of pages
+	struct shm *shm_next;		// Next segment
+} shm_t;
+
 
 // Clock frequency: the clock interrupt, if any, happens HZ times a second
 #define HZ			100
@@ -43,21 +82,118 @@ typedef struct process {
 #define INT_HARDWARE		32
 #define INT_CLOCK		(INT_HARDWARE + 0)
 
+// The page fault exception number
+#define INT_PAGEFAULT		14
+
+// The device-not-available exception number: a floating-point or SSE
+// instruction ran with CR0_TS set (see fpu_init())
+#define INT_FPU			7
+
 // Top of the kernel stack
 #define KERNEL_STACK_TOP	0x180000
 
+// Physical memory from PALLOC_START to the top of RAM belongs to the page
+// allocator (k-palloc.c), which hands it out in blocks of up to
+// 2^PAGE_MAX_ORDER pages
+#define PALLOC_START		0x200000
+#define PAGE_MAX_ORDER		10
+
+// Process memory lives at virtual addresses [PROC_VA_START, PROC_VA_END).
+// The kernel's identity mapping of physical memory stops below
+// PROC_VA_START, so RAM above that is not used.  Each process's stack
+// occupies the top PROC_STACK_SIZE bytes of the range.
+#define PROC_VA_START		0x40000000
+#define PROC_VA_END		0x80000000
+#define PROC_STACK_SIZE		0x4000
+
+// Shared memory segments attach at virtual addresses [PROC_SHM_START,
+// PROC_SHM_END), which is clear of programs and of the stack's page table.
+#define PROC_SHM_START		0x70000000
+#define PROC_SHM_END		(PROC_VA_END - PTSIZE)
+
+// An object cache; see k-slab.c
+typedef struct slab slab_t;
+typedef struct slab_cache {
+	const char *sc_name;		// Name, for statistics
+	size_t sc_size;			// Object size
+	int sc_objs_per_slab;		// Objects that fit in one slab
+	int sc_ncolors;			// Number of slab colors
+	int sc_color_next;		// Color of the next new slab
+	slab_t *sc_partial;		// Slabs with free and used objects
+	slab_t *sc_empty;		// A spare slab with no used objects
+	struct slab_cache *sc_next_cache;	// Next cache, for statistics
+
+	uint32_t sc_nslabs;		// Statistics: see slabstats_t
+	uint32_t sc_inuse;
+	uint32_t sc_nallocs;
+	uint32_t sc_nfrees;
+	uint32_t sc_alloc_cycles;
+} slab_cache_t;
+
+// Software page table entry bits, in PTE_AVAIL
+#define PTE_COW			0x200		// Copy-on-write: shared, and
+						// writable once copied
+#define PTE_ZERO		0x400		// Not present yet: demand-zero
+#define PTE_SHARED		0x800		// Shared memory: stays shared
+						// in pagedir_fork()
+
+// Program loader modes (see k-loader.c)
+#define LOADER_MAP		0		// Map program pages on demand
+#define LOADER_COPY		1		// Copy the whole program
+
 // Functions defined in kernel.c
 void interrupt(registers_t *reg);
 void schedule(void);
+void kerneldata_update(process_t *proc);
+void kernel_panic(const char *format, ...) __attribute__((noreturn));
+
+// Function defined in k-int.S
+void idle_loop(void) __attribute__((noreturn));
 
 // Functions defined in x86.c
 void segments_init(void);
 void interrupt_controller_init(bool_t allow_clock_interrupt);
 void special_registers_init(process_t *proc);
+void fpu_init(void);
+void fpu_trap(void);
+void fpu_release(process_t *proc);
+void fpu_sync(process_t *proc);
 void console_clear(void);
 int console_read_digit(void);
-// Function defined in k-loader.c
-void program_loader(int programnumber, uint32_t *entry_point);
+uint32_t cycle_counter_calibrate(void);
+physaddr_t physical_memory_size(void);
+void virtual_memory_init(physaddr_t ram_top);
+pagedirectory_t pagedir_create(void);
+pagedirectory_t pagedir_fork(pagedirectory_t pagedir);
+void pagedir_free(pagedirectory_t pagedir);
+int virtual_memory_map(pagedirectory_t pagedir, uintptr_t va, physaddr_t pa,
+		       size_t size, int perm);
+pte_t *virtual_memory_lookup(pagedirectory_t pagedir, uintptr_t va);
+int virtual_memory_fault(pagedirectory_t pagedir, uintptr_t va, bool_t write);
+bool_t virtual_memory_check(pagedirectory_t pagedir, uintptr_t va,
+			    size_t size, int perm);
+extern pagedirectory_t kernel_pagedir;
+// Functions defined in k-palloc.c
+void page_alloc_init(physaddr_t ram_top);
+physaddr_t page_alloc(int order);
+void page_free(physaddr_t pa, int order);
+void page_split(physaddr_t pa, int order);
+void page_incref(physaddr_t pa);
+void page_decref(physaddr_t pa);
+int page_refcount(physaddr_t pa);
+size_t page_alloc_free_pages(void);
+// Functions defined in k-slab.c
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t size);
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *obj);
+int slab_cache_stats(int index, slabstats_t *ss);
+// Functions and variable defined in k-loader.c
+extern int loader_mode;
+int program_count(void);
+int program_loader(int programnumber, pagedirectory_t pagedir,
+		   uint32_t *entry_point);
+// Function defined in k-bench.c
+void benchmarks_run(void);
 
 extern process_t *current;
 void run(process_t *proc) __attribute__((noreturn));
@@ -14,6 +14,21 @@
 #define RUNCOUNT	320
 
 
+/*****************************************************************************
+ * sys_getpid
+ *
+ *   Returns the current process's process ID.  This is not really a system
+ *   call: it just reads the kernel data page (see schedos.h).
+ *
+ *****************************************************************************/
+
+static inline pid_t
+sys_getpid(void)
+{
+	return kerneldata.kd_pid;
+}
+
+
 /*****************************************************************************
  * sys_yield
  *
@@ -35,6 +50,31 @@ sys_yield(void)
 }
 
 
+/*****************************************************************************
+ * sys_yield_to(pid)
+ *
+ *   Yield control of the CPU directly to process 'pid', skipping the
+ *   scheduling policy.  'pid' runs for the rest of the caller's time
+ *   quantum.  Use this to hand off work to a cooperating process in a
+ *   single context switch.
+ *   Returns 0 (once the caller is scheduled again), or -1 without yielding
+ *   if 'pid' is the caller or is not runnable.
+ *
+ *****************************************************************************/
+
+static inline int
+sys_yield_to(pid_t pid)
+{
+	int result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_YIELD_TO),
+		       "a" (pid)
+		     : "cc", "memory");
+	return result;
+}
+
+
 /*****************************************************************************
  * sys_exit(status)
  *
@@ -61,4 +101,233 @@ sys_exit(int status)
     loop: goto loop; // Convince GCC that function truly does not return.
 }
 
+
+/*****************************************************************************
+ * sys_loadavg(pid, la)
+ *
+ *   Copy the system load averages, plus the load averages of process 'pid',
+ *   into '*la'.  If 'pid' is 0, report the calling process's averages.
+ *   The kernel updates the averages on every clock tick, HZ times a
+ *   second.
+ *   Returns 0 on success, or -1 if 'pid' does not name a process.
+ *   See schedos.h for what the fields mean.
+ *
+ *****************************************************************************/
+
+static inline int
+sys_loadavg(pid_t pid, loadavg_t *la)
+{
+	// This system call takes two arguments, in %eax and %ebx, and
+	// returns its result in %eax.
+	int result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_LOADAVG),
+		       "a" (pid),
+		       "b" (la)
+		     : "cc", "memory");
+	return result;
+}
+
+
+/*****************************************************************************
+ * sys_set_bandwidth(pid, quota, period)
+ *
+ *   Limit process 'pid' (or the calling process, if 'pid' is 0) to at most
+ *   'quota' clock ticks of CPU time in every 'period' ticks.  A process
+ *   that uses up its quota is blocked until the start of its next period,
+ *   even if the CPU is otherwise idle.  The kernel enforces the limit on
+ *   each clock tick.  A 'quota' of 0 removes the limit.
+ *   Returns 0 on success, or -1 if 'pid' does not name a process or
+ *   'quota' > 'period'.
+ *
+ *****************************************************************************/
+
+static inline int
+sys_set_bandwidth(pid_t pid, int quota, int period)
+{
+	int result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_BANDWIDTH),
+		       "a" (pid),
+		       "b" (quota),
+		       "c" (period)
+		     : "cc", "memory");
+	return result;
+}
+
+
+/*****************************************************************************
+ * sys_slab_stats(index, ss)
+ *
+ *   Copy the statistics of kernel object cache number 'index' into '*ss'.
+ *   Returns 0 on success, or -1 if there is no such cache, so a loop from
+ *   index 0 up visits every cache.  See schedos.h for what the fields mean.
+ *
+ *****************************************************************************/
+
+static inline int
+sys_slab_stats(int index, slabstats_t *ss)
+{
+	int result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_SLABSTATS),
+		       "a" (index),
+		       "b" (ss)
+		     : "cc", "memory");
+	return result;
+}
+
+
+/*****************************************************************************
+ * sys_launch(program)
+ *
+ *   Start a new process running program number 'program' (program N is
+ *   p-schedos-app-N).  Every process has its own address space, so a
+ *   program can run in any number of processes at once.  Returns the new
+ *   process's ID, or -1 if there is no such program or no room for
+ *   another process.
+ *
+ *****************************************************************************/
+
+static inline pid_t
+sys_launch(int program)
+{
+	pid_t result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_LAUNCH),
+		       "a" (program)
+		     : "cc", "memory");
+	return result;
+}
+
+
+/*****************************************************************************
+ * sys_snapshot
+ *
+ *   Save a snapshot of the calling process: its memory, and its registers
+ *   as of this call.  Returns the snapshot's ID, which is positive, or -1
+ *   if out of memory.  A process started from the snapshot resumes from
+ *   this same call, where it returns 0 instead.
+ *
+ *   The snapshot shares the caller's memory copy-on-write, so taking it,
+ *   and starting processes from it, copies page tables but no data.  A
+ *   program can do its expensive setup once, take a snapshot, and start
+ *   further copies of itself already set up.
+ *
+ * sys_snapshot_launch(id)
+ *
+ *   Start a new process from snapshot 'id'.  Returns the new process's ID,
+ *   or -1 if there is no such snapshot or no room for another process.
+ *
+ * sys_snapshot_free(id)
+ *
+ *   Discard snapshot 'id'.  Processes already started from it carry on.
+ *   Returns 0, or -1 if there is no such snapshot.
+ *
+ *****************************************************************************/
+
+static inline int
+sys_snapshot(void)
+{
+	int result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_SNAPSHOT)
+		     : "cc", "memory");
+	return result;
+}
+
+static inline pid_t
+sys_snapshot_launch(int id)
+{
+	pid_t result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_SNAPSHOT_LAUNCH),
+		       "a" (id)
+		     : "cc", "memory");
+	return result;
+}
+
+static inline int
+sys_snapshot_free(int id)
+{
+	int result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_SNAPSHOT_FREE),
+		       "a" (id)
+		     : "cc", "memory");
+	return result;
+}
+
+
+/*****************************************************************************
+ * sys_shm_create(size)
+ *
+ *   Create a shared memory segment of at least 'size' bytes, filled with
+ *   zeroes, and return its ID, which is positive.  Any process can attach
+ *   the segment by ID.  Segments are whole pages, so they are page- and
+ *   therefore cache-line-aligned; the largest is 4 MB.  Returns -1 if
+ *   'size' is 0 or too large, or if out of memory.
+ *
+ * sys_shm_attach(id)
+ *
+ *   Map shared memory segment 'id' into the caller's memory, readable and
+ *   writable, and return its address, or NULL if there is no such segment
+ *   or no room to map it.  Every process that attaches a segment sees the
+ *   same memory, and so do processes started from a snapshot (see
+ *   sys_snapshot()) of a process that had attached it.  A segment stays
+ *   attached until the process exits.  A 4 MB segment is attached at a
+ *   4 MB-aligned address, with a single large page where the processor
+ *   supports them.
+ *
+ * sys_shm_destroy(id)
+ *
+ *   Remove the ID of shared memory segment 'id', so no more processes can
+ *   attach it.  The memory is freed once no process has it attached.
+ *   Returns 0, or -1 if there is no such segment.
+ *
+ *****************************************************************************/
+
+static inline int
+sys_shm_create(size_t size)
+{
+	int result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_SHM_CREATE),
+		       "a" (size)
+		     : "cc", "memory");
+	return result;
+}
+
+static inline void *
+sys_shm_attach(int id)
+{
+	void *result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_SHM_ATTACH),
+		       "a" (id)
+		     : "cc", "memory");
+	return result;
+}
+
+static inline int
+sys_shm_destroy(int id)
+{
+	int result;
+	asm volatile("int %1\n"
+		     : "=a" (result)
+		     : "i" (INT_SYS_SHM_DESTROY),
+		       "a" (id)
+		     : "cc", "memory");
+	return result;
+}
+
 #endif
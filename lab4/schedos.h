@@ -16,10 +16,80 @@
 #define INT_SYS_EXIT		49
 #define INT_SYS_USER1		50
 #define INT_SYS_USER2		51
+#define INT_SYS_LOADAVG		52
+#define INT_SYS_BANDWIDTH	53
+#define INT_SYS_YIELD_TO	54
+#define INT_SYS_SLABSTATS	55
+#define INT_SYS_LAUNCH		56
+#define INT_SYS_SNAPSHOT	57
+#define INT_SYS_SNAPSHOT_LAUNCH	58
+#define INT_SYS_SNAPSHOT_FREE	59
+#define INT_SYS_SHM_CREATE	60
+#define INT_SYS_SHM_ATTACH	61
+#define INT_SYS_SHM_DESTROY	62
+
+
+// Load averages, as returned by sys_loadavg().
+// Every average is a fixed-point number with LOAD_FSHIFT fraction bits, so
+// LOAD_FIXED_1 means "1.0".  The system load is the decayed average number
+// of runnable processes over windows of 1, 5, and 15 seconds (HZ, 5 * HZ
+// and 15 * HZ clock ticks).  The per-process averages are the decayed
+// fraction of clock ticks, over a 1-second window, during which the process
+// was runnable or actually running.
+
+#define LOAD_FSHIFT		16
+#define LOAD_FIXED_1		(1 << LOAD_FSHIFT)
+
+typedef struct loadavg {
+	uint32_t la_ticks;		// Clock ticks since boot
+	uint32_t la_nrunnable;		// Number of runnable processes
+	uint32_t la_load[3];		// System load: 1, 5, 15 seconds
+	uint32_t la_runnable_avg;	// Process's runnable average
+	uint32_t la_running_avg;	// Process's running average
+} loadavg_t;
+
+
+// Kernel object cache statistics, as returned by sys_slab_stats().
+// A cache's occupancy is ss_inuse out of ss_nslabs * ss_objs_per_slab
+// objects.
+
+typedef struct slabstats {
+	char ss_name[16];		// Cache name
+	uint32_t ss_objsize;		// Object size, in bytes
+	uint32_t ss_objs_per_slab;	// Objects per slab (one page)
+	uint32_t ss_nslabs;		// Slabs the cache holds
+	uint32_t ss_inuse;		// Objects allocated now
+	uint32_t ss_nallocs;		// Allocations since boot
+	uint32_t ss_nfrees;		// Frees since boot
+	uint32_t ss_alloc_cycles;	// Recent average cycles per allocation,
+					// sampled (see k-slab.c)
+} slabstats_t;
 
 
 // The current screen cursor position (stored at memory location 0x198000).
 
 extern uint16_t * volatile cursorpos;
 
+
+// The kernel data page (stored at memory location 0x199000).
+// The kernel keeps this page up to date with information about the system
+// and the running process, so applications can read that information with
+// plain loads instead of system calls.  Applications must not write it.
+
+typedef struct kerneldata {
+	pid_t kd_pid;			// Running process's ID
+	uint32_t kd_ticks;		// Clock ticks since boot
+	uint32_t kd_tsc_khz;		// Cycle counter rate, in cycles per ms
+	uint32_t kd_nrunnable;		// Number of runnable processes
+	uint32_t kd_runtime;		// Clock ticks charged to this process
+	uint32_t kd_runnable_avg;	// This process's load averages
+	uint32_t kd_running_avg;	// (see loadavg_t)
+} kerneldata_t;
+
+#ifdef WEENSYOS_KERNEL
+extern volatile kerneldata_t kerneldata;
+#else
+extern const volatile kerneldata_t kerneldata;
+#endif
+
 #endif
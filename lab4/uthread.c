@@ -0,0 +1,253 @@
+#include "uthread.h"
+#include "process.h"
+
+/*****************************************************************************
+ * uthread.c
+ *
+ *   User-level threads and channels; see uthread.h.
+ *
+ *****************************************************************************/
+
+typedef enum uthread_state {
+	UT_FREE = 0,			// This slot is unused
+	UT_RUNNABLE,			// Running, or on the run queue
+	UT_BLOCKED			// Waiting on a channel
+} uthread_state_t;
+
+struct uthread {
+	uint32_t ut_esp;		// Saved stack pointer; the thread's
+					// registers are saved on its stack
+	uthread_state_t ut_state;
+	uthread_t *ut_next;		// Next thread on the run queue, or on
+					// a channel's wait list
+	void (*ut_fn)(void *);		// Thread body and its argument
+	void *ut_arg;
+};
+
+static uthread_t uthreads[UTHREAD_MAX];
+static uint8_t uthread_stacks[UTHREAD_MAX - 1][UTHREAD_STACK_SIZE]
+	__attribute__((aligned(16)));
+
+static uthread_t *uthread_current;	// The running thread
+static uthread_t *runq_head;		// Runnable threads, other than
+static uthread_t *runq_tail;		// uthread_current, in FIFO order
+static int uthread_count;		// Number of live threads
+
+// Defined in uthread-switch.S: save the callee-saved registers on the
+// current stack, store the stack pointer in '*save_esp', then switch to
+// stack 'new_esp' and restore the registers saved there.
+void uthread_switch(uint32_t *save_esp, uint32_t new_esp);
+
+
+// The first call into the library turns the caller into thread 0.
+static void
+uthread_init(void)
+{
+	if (!uthread_current) {
+		uthread_current = &uthreads[0];
+		uthread_current->ut_state = UT_RUNNABLE;
+		uthread_count = 1;
+	}
+}
+
+static void
+list_append(uthread_t **head, uthread_t *t)
+{
+	t->ut_next = NULL;
+	while (*head)
+		head = &(*head)->ut_next;
+	*head = t;
+}
+
+static void
+runq_push(uthread_t *t)
+{
+	t->ut_next = NULL;
+	if (runq_tail)
+		runq_tail->ut_next = t;
+	else
+		runq_head = t;
+	runq_tail = t;
+}
+
+static uthread_t *
+runq_pop(void)
+{
+	uthread_t *t = runq_head;
+	if (t) {
+		runq_head = t->ut_next;
+		if (!runq_head)
+			runq_tail = NULL;
+	}
+	return t;
+}
+
+// Switch to the next thread on the run queue.  The caller has already put
+// the current thread where it belongs: on the run queue, on a wait list,
+// or nowhere (if it exited).  Threads block only on channels, which only
+// other threads of this process can wake; so if no thread is runnable,
+// none ever will be, and the process exits with UTHREAD_DEADLOCK.
+static void
+uthread_schedule(void)
+{
+	uthread_t *prev = uthread_current, *next;
+
+	if (!(next = runq_pop())) {
+		sys_exit(UTHREAD_DEADLOCK);
+	}
+
+	uthread_current = next;
+	if (next != prev)
+		uthread_switch(&prev->ut_esp, next->ut_esp);
+}
+
+// New threads start here, on their own stack.
+static void
+uthread_start(void)
+{
+	uthread_current->ut_fn(uthread_current->ut_arg);
+	uthread_exit();
+}
+
+
+/*****************************************************************************
+ * uthread_create, uthread_yield, uthread_exit, uthread_self
+ *
+ *****************************************************************************/
+
+int
+uthread_create(void (*fn)(void *), void *arg)
+{
+	int tid;
+	uthread_t *t;
+	uint32_t *sp;
+
+	uthread_init();
+	for (tid = 1; tid < UTHREAD_MAX; tid++)
+		if (uthreads[tid].ut_state == UT_FREE)
+			break;
+	if (tid == UTHREAD_MAX)
+		return -1;
+
+	t = &uthreads[tid];
+	t->ut_fn = fn;
+	t->ut_arg = arg;
+
+	// Lay out the new stack the way uthread_switch() leaves a stack it
+	// switches away from, so that switching to it "returns" into
+	// uthread_start() with zeroed callee-saved registers.
+	sp = (uint32_t *) (uthread_stacks[tid - 1] + UTHREAD_STACK_SIZE);
+	*--sp = 0;			// uthread_start's return address
+	*--sp = (uint32_t) uthread_start;
+	*--sp = 0;			// %ebp
+	*--sp = 0;			// %ebx
+	*--sp = 0;			// %esi
+	*--sp = 0;			// %edi
+	t->ut_esp = (uint32_t) sp;
+
+	t->ut_state = UT_RUNNABLE;
+	uthread_count++;
+	runq_push(t);
+	return tid;
+}
+
+void
+uthread_yield(void)
+{
+	uthread_init();
+	if (!runq_head)
+		return;
+	runq_push(uthread_current);
+	uthread_schedule();
+}
+
+void
+uthread_exit(void)
+{
+	uthread_init();
+	uthread_current->ut_state = UT_FREE;
+	if (--uthread_count == 0)
+		sys_exit(0);
+	uthread_schedule();
+
+	// uthread_schedule() never switches back to an exited thread.
+	while (1)
+		/* do nothing */;
+}
+
+int
+uthread_self(void)
+{
+	uthread_init();
+	return uthread_current - uthreads;
+}
+
+
+/*****************************************************************************
+ * uthread_chan_init, uthread_chan_send, uthread_chan_recv
+ *
+ *****************************************************************************/
+
+// Block the current thread on wait list '*list' and run another thread.
+static void
+chan_wait(uthread_t **list)
+{
+	uthread_current->ut_state = UT_BLOCKED;
+	list_append(list, uthread_current);
+	uthread_schedule();
+}
+
+// Make the first thread on wait list '*list', if any, runnable.
+static void
+chan_wake(uthread_t **list)
+{
+	uthread_t *t = *list;
+	if (t) {
+		*list = t->ut_next;
+		t->ut_state = UT_RUNNABLE;
+		runq_push(t);
+	}
+}
+
+void
+uthread_chan_init(uthread_chan_t *ch, uint32_t *buf, int capacity)
+{
+	ch->ch_buf = buf;
+	ch->ch_capacity = capacity;
+	ch->ch_head = ch->ch_count = 0;
+	ch->ch_senders = ch->ch_receivers = NULL;
+}
+
+void
+uthread_chan_send(uthread_chan_t *ch, uint32_t value)
+{
+	int tail;
+
+	uthread_init();
+	while (ch->ch_count == ch->ch_capacity)
+		chan_wait(&ch->ch_senders);
+
+	tail = ch->ch_head + ch->ch_count;
+	if (tail >= ch->ch_capacity)
+		tail -= ch->ch_capacity;
+	ch->ch_buf[tail] = value;
+	ch->ch_count++;
+	chan_wake(&ch->ch_receivers);
+}
+
+uint32_t
+uthread_chan_recv(uthread_chan_t *ch)
+{
+	uint32_t value;
+
+	uthread_init();
+	while (ch->ch_count == 0)
+		chan_wait(&ch->ch_receivers);
+
+	value = ch->ch_buf[ch->ch_head];
+	if (++ch->ch_head == ch->ch_capacity)
+		ch->ch_head = 0;
+	ch->ch_count--;
+	chan_wake(&ch->ch_senders);
+	return value;
+}
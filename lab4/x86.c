@@ -70,6 +70,8 @@ pseudodescriptor_t interrupt_descriptor_table = {
 
 // Particular interrupt handler routines
 extern void clock_int_handler(void);
+extern void fpu_int_handler(void);
+extern void page_fault_int_handler(void);
 extern void (*sys_int_handlers[])(void);
 extern void default_int_handler(void);
 
@@ -99,10 +101,18 @@ segments_init(void)
 	SETGATE(interrupt_descriptors[INT_CLOCK], 0,
 		SEGSEL_KERN_CODE, clock_int_handler, 0);
 
+	// So do page faults
+	SETGATE(interrupt_descriptors[INT_PAGEFAULT], 0,
+		SEGSEL_KERN_CODE, page_fault_int_handler, 0);
+
+	// So does the first FPU use after a context switch (see fpu_init()).
+	SETGATE(interrupt_descriptors[INT_FPU], 0,
+		SEGSEL_KERN_CODE, fpu_int_handler, 0);
+
 	// System calls get special handling.
 	// Note that the last argument is '3'.  This means that unprivileged
 	// (level-3) applications may generate these interrupts.
-	for (i = INT_SYS_YIELD; i < INT_SYS_YIELD + 10; i++)
+	for (i = INT_SYS_YIELD; i < INT_SYS_YIELD + 15; i++)
 		SETGATE(interrupt_descriptors[i], 0,
 			SEGSEL_KERN_CODE, sys_int_handlers[i - INT_SYS_YIELD], 3);
 
@@ -215,6 +225,48 @@ interrupt_controller_init(bool_t allow_clock_interrupt)
 
 
 
+/*****************************************************************************
+ * cycle_counter_calibrate
+ *
+ *   Measure the rate of the cycle counter (see read_cycle_counter()), in
+ *   cycles per millisecond, by timing 10 ms on channel 2 of the 8253 timer.
+ *   Channel 2 normally drives the PC speaker; the speaker stays off.
+ *
+ *****************************************************************************/
+
+#define	IO_TIMER2	(IO_TIMER1 + 2)	/* 8253 Timer #2 */
+#define	  TIMER_SEL2	0x80		/* select counter 2 */
+#define	  TIMER_INTTC	0x00		/* mode 0, intr on terminal cnt */
+#define	IO_PPI		0x61		/* timer 2 gate and speaker control */
+#define	  PPI_TIMER2_GATE	0x01
+#define	  PPI_SPEAKER		0x02
+#define	  PPI_TIMER2_OUT	0x20
+
+uint32_t
+cycle_counter_calibrate(void)
+{
+	uint8_t ppi = inb(IO_PPI);
+	uint64_t start, end;
+
+	// Enable counting on timer 2, but keep the speaker disconnected
+	outb(IO_PPI, (ppi & ~PPI_SPEAKER) | PPI_TIMER2_GATE);
+
+	// Count down 10 ms; the timer's output goes high when it hits zero
+	outb(TIMER_MODE, TIMER_SEL2 | TIMER_INTTC | TIMER_16BIT);
+	outb(IO_TIMER2, TIMER_DIV(100) % 256);
+	outb(IO_TIMER2, TIMER_DIV(100) / 256);
+
+	start = read_cycle_counter();
+	while (!(inb(IO_PPI) & PPI_TIMER2_OUT))
+		/* do nothing */;
+	end = read_cycle_counter();
+
+	outb(IO_PPI, ppi);
+	return (uint32_t) (end - start) / 10;
+}
+
+
+
 /*****************************************************************************
  * special_registers_init
  *
@@ -238,6 +290,392 @@ special_registers_init(process_t *proc)
 
 
 
+/*****************************************************************************
+ * physical_memory_size
+ *
+ *   Return the amount of RAM in the machine, in bytes, as the BIOS recorded
+ *   it in the CMOS: registers 0x30-0x31 hold the KB of memory between 1 MB
+ *   and 64 MB, and registers 0x34-0x35 the 64 KB chunks above 16 MB.
+ *
+ *****************************************************************************/
+
+#define	IO_RTC		0x70		/* RTC/CMOS index port */
+#define	  CMOS_EXTMEM_LO	0x30	/* KB above 1 MB, low byte */
+#define	  CMOS_EXTMEM_HI	0x31
+#define	  CMOS_EXTMEM2_LO	0x34	/* 64 KB chunks above 16 MB */
+#define	  CMOS_EXTMEM2_HI	0x35
+
+static uint8_t
+cmos_read(uint8_t reg)
+{
+	outb(IO_RTC, reg);
+	return inb(IO_RTC + 1);
+}
+
+physaddr_t
+physical_memory_size(void)
+{
+	uint32_t extmem = cmos_read(CMOS_EXTMEM_LO)
+		| (cmos_read(CMOS_EXTMEM_HI) << 8);
+	uint32_t extmem2 = cmos_read(CMOS_EXTMEM2_LO)
+		| (cmos_read(CMOS_EXTMEM2_HI) << 8);
+
+	if (extmem2)
+		return 0x1000000 + (extmem2 << 16);
+	else
+		return 0x100000 + (extmem << 10);
+}
+
+
+
+/*****************************************************************************
+ * virtual_memory_init(ram_top)
+ *
+ *   Set up the kernel's page directory and turn on paging.
+ *
+ *   The kernel's page directory identity-maps physical memory from PAGESIZE
+ *   up to 'ram_top'.  (Page 0 stays unmapped, to catch null pointers.)
+ *   Only the kernel can use these mappings.  Each process gets its own page
+ *   directory, made by pagedir_create(), which starts out with the same
+ *   kernel mappings and adds the process's own memory on top.
+ *
+ *   The kernel's mappings are global (PTE_G).  With CR4_PGE set, the
+ *   processor keeps global translations in the TLB when %cr3 changes, so
+ *   a context switch between page directories only loses the outgoing
+ *   process's own translations.  (Process-context identifiers, CR4_PCIDE,
+ *   would keep those too, but x86 processors support them only in 64-bit
+ *   mode.)
+ *
+ *   Where the processor supports 4 MB pages (CR4_PSE), the kernel maps
+ *   every whole 4 MB of memory above the first with a single page directory
+ *   entry (PTE_PS) instead of a page table.  That saves a page table per
+ *   4 MB, and lets one TLB entry cover what would otherwise take 1024.
+ *   The first 4 MB still uses a page table, since page 0 stays unmapped and
+ *   processes map the console and shared data there.
+ *
+ *   Page directories and page tables come from the page allocator
+ *   (k-palloc.c), which must be initialized first.
+ *
+ *****************************************************************************/
+
+// The kernel's page directory
+pagedirectory_t kernel_pagedir;
+
+// True if the processor supports 4 MB pages
+static bool_t large_pages;
+
+static pte_t *
+pagetable_alloc(void)
+{
+	pte_t *pt = (pte_t *) page_alloc(0);
+	if (pt)
+		memset(pt, 0, PAGESIZE);
+	return pt;
+}
+
+// Return a pointer to the page table entry for 'va' in 'pagedir'.
+// If 'create' is true, allocate the page table if necessary.  The page
+// tables holding kernel mappings are shared by every page directory, so in
+// that case a page table still shared with 'kernel_pagedir' is replaced
+// with a private copy first.
+// If a 4 MB page maps 'va', return its page directory entry instead (or,
+// if 'create' is true, NULL: a 4 MB page cannot hold 4 KB mappings).
+// Returns NULL if there is no page table (or no memory to make one).
+static pte_t *
+pagetable_walk(pagedirectory_t pagedir, uintptr_t va, bool_t create)
+{
+	pte_t *pde = &pagedir[PDX(va)];
+	pte_t *pt;
+
+	if ((*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return create ? NULL : pde;
+	if (create && (!(*pde & PTE_P) || (pagedir != kernel_pagedir
+					   && *pde == kernel_pagedir[PDX(va)]))) {
+		if (!(pt = pagetable_alloc()))
+			return NULL;
+		if (*pde & PTE_P)
+			memcpy(pt, (pte_t *) PTE_ADDR(*pde), PAGESIZE);
+		*pde = (physaddr_t) pt | PTE_P | PTE_W | PTE_U;
+	} else if (!(*pde & PTE_P))
+		return NULL;
+
+	return &((pte_t *) PTE_ADDR(*pde))[PTX(va)];
+}
+
+void
+virtual_memory_init(physaddr_t ram_top)
+{
+	uintptr_t va;
+	uint32_t edx, global = 0;
+	pte_t *pte;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_EDX_PGE) {
+		lcr4(rcr4() | CR4_PGE);
+		global = PTE_G;
+	}
+	if (edx & CPUID_EDX_PSE) {
+		lcr4(rcr4() | CR4_PSE);
+		large_pages = 1;
+	}
+
+	if (!(kernel_pagedir = pagetable_alloc()))
+		kernel_panic("Out of memory for the kernel page directory!\n");
+	for (va = PAGESIZE; va < ram_top; va += PAGESIZE)
+		if (large_pages && va % PTSIZE == 0 && va + PTSIZE <= ram_top) {
+			kernel_pagedir[PDX(va)] = va | PTE_P | PTE_W | PTE_PS
+				| global;
+			va += PTSIZE - PAGESIZE;
+		} else if ((pte = pagetable_walk(kernel_pagedir, va, 1)))
+			*pte = va | PTE_P | PTE_W | global;
+		else
+			kernel_panic("Out of memory for kernel page tables!\n");
+
+	// Leave CR0_WP off, so the kernel can write to pages that are
+	// read-only for processes (like the kernel data page).
+	lcr3(kernel_pagedir);
+	lcr0(rcr0() | CR0_PG);
+}
+
+
+
+/*****************************************************************************
+ * pagedir_create
+ *
+ *   Return a new page directory containing just the kernel's mappings,
+ *   or NULL if out of memory.
+ *
+ * pagedir_fork(pagedir)
+ *
+ *   Return a copy of process page directory 'pagedir', or NULL if out of
+ *   memory.  The copy shares every process page with the original.  Pages
+ *   from the page allocator that were writable become read-only and
+ *   copy-on-write in both, so whichever side writes to such a page first
+ *   gets its own copy (see virtual_memory_fault()).  Writable pages the
+ *   allocator does not own, like the console, and shared memory segments
+ *   (PTE_SHARED) stay shared.  Only page tables are copied.
+ *
+ * pagedir_free(pagedir)
+ *
+ *   Free a page directory made by pagedir_create() or pagedir_fork(),
+ *   along with its private page tables, dropping a reference to every page
+ *   it maps for processes (see page_decref()).  'pagedir' must not be the
+ *   current page directory.
+ *
+ * virtual_memory_map(pagedir, va, pa, size, perm)
+ *
+ *   Map virtual addresses [va, va + size) to physical addresses
+ *   [pa, pa + size) in 'pagedir', with permissions 'perm' (a combination of
+ *   PTE_W, PTE_U, and PTE_COW).  Addresses are rounded out to page
+ *   boundaries.  If 'perm' includes PTE_ZERO, 'pa' is ignored: the pages
+ *   are left not present, to be filled with zeroes on first access (see
+ *   virtual_memory_fault()).  Returns 0 on success, or -1 if out of memory.
+ *
+ *   If 'perm' includes PTE_PS, the range is mapped with 4 MB pages
+ *   instead, one page directory entry each.  Then 'va', 'pa', and 'size'
+ *   must be multiples of PTSIZE, and nothing may be mapped in the range
+ *   yet; otherwise, or if the processor lacks 4 MB pages, this returns -1.
+ *   pagedir_fork() shares 4 MB pages rather than making them copy-on-write.
+ *   A 4 MB page mapped for processes (PTE_U) is reference counted like
+ *   1024 ordinary pages: pagedir_fork() and pagedir_free() add or drop a
+ *   reference to each of its 4 KB pages.  Other 4 MB pages are not
+ *   reference counted, so whoever allocated their memory frees it.
+ *
+ * virtual_memory_lookup(pagedir, va)
+ *
+ *   Return a pointer to the page table entry for 'va' in 'pagedir' (or,
+ *   for a 4 MB page, its page directory entry), or NULL if there is no
+ *   page table for 'va'.
+ *
+ * virtual_memory_fault(pagedir, va, write)
+ *
+ *   Handle a process's page fault on 'va' in 'pagedir', where 'write' says
+ *   whether the access was a write.  A demand-zero page gets a fresh zeroed
+ *   page; a write to a copy-on-write page gets a private copy of the page
+ *   (or, if no one else still shares the page, just write permission).
+ *   Returns 0 if the access can now succeed, or -1 if it is not allowed
+ *   (or there is no memory to allow it).
+ *
+ * virtual_memory_check(pagedir, va, size, perm)
+ *
+ *   Return true iff every page in [va, va + size) is mapped in 'pagedir'
+ *   with at least permissions 'perm'.  The kernel uses this to check
+ *   pointers passed in by processes, before it touches their memory, so
+ *   demand-zero and copy-on-write pages are faulted in as needed.
+ *
+ *****************************************************************************/
+
+// Apply 'ref' (page_incref or page_decref) to each 4 KB page of the 4 MB
+// page that 'pde' maps, if it is mapped for processes.
+static void
+large_page_refs(pte_t pde, void (*ref)(physaddr_t pa))
+{
+	physaddr_t pa;
+	if (pde & PTE_U)
+		for (pa = PTE_ADDR(pde); pa < PTE_ADDR(pde) + PTSIZE;
+		     pa += PAGESIZE)
+			ref(pa);
+}
+
+pagedirectory_t
+pagedir_create(void)
+{
+	pagedirectory_t pagedir = pagetable_alloc();
+	if (pagedir)
+		memcpy(pagedir, kernel_pagedir, PAGESIZE);
+	return pagedir;
+}
+
+pagedirectory_t
+pagedir_fork(pagedirectory_t pagedir)
+{
+	pagedirectory_t child = pagedir_create();
+	int i, j;
+
+	for (i = 0; child && i < NPTENTRIES; i++) {
+		pte_t *pt = (pte_t *) PTE_ADDR(pagedir[i]), *child_pt;
+		if (!(pagedir[i] & PTE_P) || pagedir[i] == kernel_pagedir[i])
+			continue;
+		if (pagedir[i] & PTE_PS) {
+			large_page_refs(pagedir[i], page_incref);
+			child[i] = pagedir[i];
+			continue;
+		}
+		if (!(child_pt = pagetable_alloc())) {
+			pagedir_free(child);
+			return NULL;
+		}
+		for (j = 0; j < NPTENTRIES; j++) {
+			if ((pt[j] & (PTE_P | PTE_U)) == (PTE_P | PTE_U)) {
+				if ((pt[j] & (PTE_W | PTE_SHARED)) == PTE_W
+				    && page_refcount(PTE_ADDR(pt[j])) > 0)
+					pt[j] = (pt[j] & ~PTE_W) | PTE_COW;
+				page_incref(PTE_ADDR(pt[j]));
+			}
+			child_pt[j] = pt[j];
+		}
+		child[i] = (physaddr_t) child_pt | PTE_P | PTE_W | PTE_U;
+	}
+
+	// The original lost write access to its pages; flush its TLB.
+	if (child && pagedir == rcr3())
+		lcr3(pagedir);
+	return child;
+}
+
+void
+pagedir_free(pagedirectory_t pagedir)
+{
+	int i, j;
+
+	for (i = 0; i < NPTENTRIES; i++) {
+		pte_t *pt = (pte_t *) PTE_ADDR(pagedir[i]);
+		if (!(pagedir[i] & PTE_P) || pagedir[i] == kernel_pagedir[i])
+			continue;
+		if (pagedir[i] & PTE_PS) {
+			large_page_refs(pagedir[i], page_decref);
+			continue;
+		}
+		for (j = 0; j < NPTENTRIES; j++)
+			if ((pt[j] & (PTE_P | PTE_U)) == (PTE_P | PTE_U))
+				page_decref(PTE_ADDR(pt[j]));
+		page_free((physaddr_t) pt, 0);
+	}
+	page_free((physaddr_t) pagedir, 0);
+}
+
+int
+virtual_memory_map(pagedirectory_t pagedir, uintptr_t va, physaddr_t pa,
+		   size_t size, int perm)
+{
+	uintptr_t end = ROUNDUP(va + size, PAGESIZE);
+	pte_t *pte;
+
+	if (perm & PTE_PS) {
+		uintptr_t x;
+		if (!large_pages || (va | pa | size) % PTSIZE != 0)
+			return -1;
+		for (x = va; x < va + size; x += PTSIZE)
+			if (pagedir[PDX(x)] & PTE_P)
+				return -1;
+		for (x = 0; x < size; x += PTSIZE)
+			pagedir[PDX(va + x)] = (pa + x) | perm | PTE_P;
+		return 0;
+	}
+
+	pa = ROUNDDOWN(pa, PAGESIZE);
+	for (va = ROUNDDOWN(va, PAGESIZE); va < end; va += PAGESIZE) {
+		if (!(pte = pagetable_walk(pagedir, va, 1)))
+			return -1;
+		*pte = (perm & PTE_ZERO ? perm : pa | perm | PTE_P);
+		if (pagedir == rcr3())
+			invlpg((void *) va);
+		pa += PAGESIZE;
+	}
+	return 0;
+}
+
+pte_t *
+virtual_memory_lookup(pagedirectory_t pagedir, uintptr_t va)
+{
+	return pagetable_walk(pagedir, va, 0);
+}
+
+int
+virtual_memory_fault(pagedirectory_t pagedir, uintptr_t va, bool_t write)
+{
+	pte_t *pte = pagetable_walk(pagedir, va, 0);
+	physaddr_t pa;
+
+	if (!pte || !(*pte & PTE_U))
+		return -1;
+
+	if (*pte & PTE_ZERO) {
+		if (!(pa = page_alloc(0)))
+			return -1;
+		memset((void *) pa, 0, PAGESIZE);
+		*pte = pa | (*pte & (PTE_U | PTE_W | PTE_COW)) | PTE_P;
+	}
+
+	if (write && (*pte & PTE_COW)) {
+		pa = PTE_ADDR(*pte);
+		if (page_refcount(pa) != 1) {
+			physaddr_t copy = page_alloc(0);
+			if (!copy)
+				return -1;
+			memcpy((void *) copy, (void *) pa, PAGESIZE);
+			page_decref(pa);
+			pa = copy;
+		}
+		*pte = pa | PTE_P | PTE_U | PTE_W;
+		if (pagedir == rcr3())
+			invlpg((void *) va);
+	}
+
+	return (*pte & PTE_P) && (!write || (*pte & PTE_W)) ? 0 : -1;
+}
+
+bool_t
+virtual_memory_check(pagedirectory_t pagedir, uintptr_t va, size_t size,
+		     int perm)
+{
+	uintptr_t end = va + size;
+	pte_t *pte;
+
+	if (end < va)
+		return 0;
+	perm |= PTE_P;
+	for (va = ROUNDDOWN(va, PAGESIZE); va < end; va += PAGESIZE)
+		if (!(pte = pagetable_walk(pagedir, va, 0))
+		    || ((*pte & perm) != perm
+			&& virtual_memory_fault(pagedir, va, perm & PTE_W) < 0)
+		    || (*pte & perm) != perm)
+			return 0;
+	return 1;
+}
+
+
+
 /*****************************************************************************
  * console_clear
  *
@@ -299,13 +737,123 @@ console_read_digit(void)
 }
 
 
+/*****************************************************************************
+ * fpu_init
+ *
+ *   Set up the floating-point unit for lazy context switching.
+ *
+ *   The kernel never uses the floating-point and SSE registers, and many
+ *   processes don't either, so context switches do not save and restore
+ *   them.  Instead the FPU holds the state of one process, 'fpu_owner'.
+ *   run() sets CR0_TS whenever it runs any other process, so that the
+ *   process's first floating-point or SSE instruction traps (INT_FPU).
+ *   fpu_trap() then saves the owner's state in its process descriptor,
+ *   loads the current process's state, and makes it the owner.  Switches
+ *   between processes that never use the FPU cost nothing extra.
+ *
+ * fpu_trap
+ *
+ *   Handle an INT_FPU exception by handing the FPU to 'current'.  A
+ *   process's first FPU use starts from a freshly initialized state.
+ *
+ * fpu_release(proc)
+ *
+ *   Forget the FPU state of 'proc', which is exiting.
+ *
+ * fpu_sync(proc)
+ *
+ *   Make 'proc->p_fpu' up to date, by saving the FPU if 'proc' owns it, so
+ *   that the state can be copied.
+ *
+ *****************************************************************************/
+
+static process_t *fpu_owner;		// Process whose state is in the FPU
+static bool_t fpu_trapping;		// Is CR0_TS set?
+static bool_t fpu_fxsr;			// Use 'fxsave'/'fxrstor'?
+static fpustate_t fpu_initial_state;	// State for a process's first use
+
+static void
+fpu_save(fpustate_t *fpu)
+{
+	if (fpu_fxsr)
+		fxsave(fpu);
+	else
+		fnsave(fpu);
+}
+
+static void
+fpu_restore(const fpustate_t *fpu)
+{
+	if (fpu_fxsr)
+		fxrstor(fpu);
+	else
+		frstor(fpu);
+}
+
+void
+fpu_init(void)
+{
+	uint32_t edx;
+
+	// 'fxsave' saves the SSE registers too, but the processor supports
+	// SSE only once the kernel says it will save them (CR4_OSFXSR).
+	cpuid(1, NULL, NULL, NULL, &edx);
+	fpu_fxsr = (edx & CPUID_EDX_FXSR) != 0;
+	if (fpu_fxsr)
+		lcr4(rcr4() | CR4_OSFXSR);
+
+	// Run floating-point instructions on the FPU, not by trapping
+	// (CR0_EM); make CR0_TS apply to 'fwait' too (CR0_MP); report
+	// floating-point errors as exceptions (CR0_NE).
+	lcr0((rcr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+	fninit();
+	fpu_save(&fpu_initial_state);
+
+	lcr0(rcr0() | CR0_TS);
+	fpu_trapping = 1;
+}
+
+void
+fpu_trap(void)
+{
+	clts();
+	fpu_trapping = 0;
+	if (fpu_owner == current)
+		return;
+	if (fpu_owner)
+		fpu_save(&fpu_owner->p_fpu);
+	fpu_restore(current->p_fpu_used ? &current->p_fpu : &fpu_initial_state);
+	current->p_fpu_used = 1;
+	fpu_owner = current;
+}
+
+void
+fpu_release(process_t *proc)
+{
+	if (fpu_owner == proc)
+		fpu_owner = NULL;
+	proc->p_fpu_used = 0;
+}
+
+void
+fpu_sync(process_t *proc)
+{
+	// The owner gives up ownership, since 'fnsave' resets the FPU.
+	if (fpu_owner == proc) {
+		fpu_save(&proc->p_fpu);
+		fpu_owner = NULL;
+	}
+}
+
+
+
 /*****************************************************************************
  * run
  *
  *   Run the process with the supplied process descriptor.
- *   This means reloading all the relevant registers from the descriptor's
- *   p_registers member, using the 'popal', 'popl', and 'iret'
- *   instructions.
+ *   This means switching to its page directory, then reloading all the
+ *   relevant registers from the descriptor's p_registers member, using the
+ *   'popal', 'popl', and 'iret' instructions.
  *
  *****************************************************************************/
 
@@ -313,6 +861,18 @@ void
 run(process_t *proc)
 {
 	current = proc;
+	kerneldata_update(proc);
+
+	// Loading %cr3 flushes the TLB's non-global entries, so skip it when
+	// the page directory is already loaded.
+	if (rcr3() != proc->p_pagedir)
+		lcr3(proc->p_pagedir);
+
+	// Only the FPU's owner may use it without trapping.
+	if ((proc != fpu_owner) != fpu_trapping) {
+		lcr0(rcr0() ^ CR0_TS);
+		fpu_trapping = !fpu_trapping;
+	}
 
 	asm volatile("movl %0,%%esp\n\t"
 		     "popal\n\t"
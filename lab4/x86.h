@@ -56,6 +56,16 @@ typedef struct registers {
 } registers_t;
 
 
+/* fpustate_t: A process's floating-point and SSE registers, in the format
+   'fxsave' stores them.  (On processors without 'fxsave', 'fnsave' stores
+   the floating-point registers alone, in the first 108 bytes.)  'fxsave'
+   requires 16-byte alignment. */
+
+typedef struct fpustate {
+	uint8_t fpu_data[512];
+} __attribute__((aligned(16))) fpustate_t;
+
+
 /*****************************************************************************
 
    x86 functions: Inline C functions that execute useful x86 instructions.
@@ -89,6 +99,12 @@ DECLARE_X86_FUNCTION(void       lcr3(pagedirectory_t val));
 DECLARE_X86_FUNCTION(pagedirectory_t rcr3(void));
 DECLARE_X86_FUNCTION(void       lcr4(uint32_t val));
 DECLARE_X86_FUNCTION(uint32_t   rcr4(void));
+DECLARE_X86_FUNCTION(void       clts(void));
+DECLARE_X86_FUNCTION(void       fninit(void));
+DECLARE_X86_FUNCTION(void       fxsave(fpustate_t *fpu));
+DECLARE_X86_FUNCTION(void       fxrstor(const fpustate_t *fpu));
+DECLARE_X86_FUNCTION(void       fnsave(fpustate_t *fpu));
+DECLARE_X86_FUNCTION(void       frstor(const fpustate_t *fpu));
 DECLARE_X86_FUNCTION(void       tlbflush(void));
 DECLARE_X86_FUNCTION(uint32_t   read_eflags(void));
 DECLARE_X86_FUNCTION(void       write_eflags(uint32_t eflags));
@@ -112,6 +128,28 @@ DECLARE_X86_FUNCTION(uint64_t   read_cycle_counter(void));
 #define CR0_CD			0x40000000	// Cache Disable
 #define CR0_PG			0x80000000	// Paging
 
+// %cr4 flag bits (useful for lcr4() and rcr4())
+#define CR4_VME			0x00000001	// V86 Mode Extensions
+#define CR4_PVI			0x00000002	// Protected-Mode Virtual Interrupts
+#define CR4_TSD			0x00000004	// Time Stamp Disable
+#define CR4_DE			0x00000008	// Debugging Extensions
+#define CR4_PSE			0x00000010	// Page Size Extensions
+#define CR4_PAE			0x00000020	// Physical Address Extension
+#define CR4_MCE			0x00000040	// Machine Check Enable
+#define CR4_PGE			0x00000080	// Page Global Enable
+#define CR4_PCE			0x00000100	// Performance counter enable
+#define CR4_OSFXSR		0x00000200	// FXSAVE/FXRSTOR support
+#define CR4_OSXMMEXCPT		0x00000400	// SIMD exception support
+#define CR4_PCIDE		0x00020000	// Process-context IDs (64-bit
+						// mode only)
+
+// cpuid(1) feature bits
+#define CPUID_EDX_PSE		0x00000008	// 4 MB pages
+#define CPUID_EDX_PGE		0x00002000	// Global pages
+#define CPUID_EDX_FXSR		0x01000000	// FXSAVE/FXRSTOR
+#define CPUID_EDX_SSE		0x02000000	// SSE
+#define CPUID_ECX_PCID		0x00020000	// Process-context IDs
+
 // eflags flag bits (useful for read_eflags() and write_eflags())
 #define EFLAGS_CF		0x00000001	// Carry Flag
 #define EFLAGS_PF		0x00000004	// Parity Flag
@@ -135,6 +173,31 @@ DECLARE_X86_FUNCTION(uint64_t   read_cycle_counter(void));
 #define EFLAGS_VIP		0x00100000	// Virtual Interrupt Pending
 #define EFLAGS_ID		0x00200000	// ID flag
 
+// Page directory and page table entries
+#define PAGESIZE		4096		// Bytes mapped by a page
+#define NPTENTRIES		1024		// Entries per page table
+#define PTSIZE			(PAGESIZE * NPTENTRIES)	// Bytes mapped by a
+							// page directory entry
+#define PDX(va)			(((uintptr_t) (va) >> 22) & 0x3FF)
+#define PTX(va)			(((uintptr_t) (va) >> 12) & 0x3FF)
+#define PTE_ADDR(pte)		((physaddr_t) (pte) & ~0xFFF)
+
+#define PTE_P			0x001		// Present
+#define PTE_W			0x002		// Writeable
+#define PTE_U			0x004		// User-accessible
+#define PTE_PWT			0x008		// Write-Through
+#define PTE_PCD			0x010		// Cache-Disable
+#define PTE_A			0x020		// Accessed
+#define PTE_D			0x040		// Dirty
+#define PTE_PS			0x080		// Page Size (4 MB page)
+#define PTE_G			0x100		// Global
+#define PTE_AVAIL		0xE00		// Available for software use
+
+// Page fault error code bits (in reg_err)
+#define PFERR_PRESENT		0x1		// Fault on a present page
+#define PFERR_WRITE		0x2		// Fault was a write
+#define PFERR_USER		0x4		// Fault happened in user mode
+
 static inline void
 breakpoint(void)
 {
@@ -311,6 +374,42 @@ rcr4(void)
 	return cr4;
 }
 
+static inline void
+clts(void)
+{
+	asm volatile("clts");
+}
+
+static inline void
+fninit(void)
+{
+	asm volatile("fninit");
+}
+
+static inline void
+fxsave(fpustate_t *fpu)
+{
+	asm volatile("fxsave %0" : "=m" (*fpu));
+}
+
+static inline void
+fxrstor(const fpustate_t *fpu)
+{
+	asm volatile("fxrstor %0" : : "m" (*fpu));
+}
+
+static inline void
+fnsave(fpustate_t *fpu)
+{
+	asm volatile("fnsave %0" : "=m" (*fpu));
+}
+
+static inline void
+frstor(const fpustate_t *fpu)
+{
+	asm volatile("frstor %0" : : "m" (*fpu));
+}
+
 static inline void
 tlbflush(void)
 {